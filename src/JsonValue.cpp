@@ -18,7 +18,12 @@
  *  @author aevum team
  */
 
+#include <algorithm>
 #include <cassert>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
 #include <utility>
 #include <sstream>
 #include <iostream>
@@ -133,36 +138,185 @@ JsonValue::item_map::const_iterator JsonValue::end() const {
     return this->as_item_map().end();
 }
 
-void JsonValue::toString(std::ostream& out, bool prettyPrint, int ident) const
-{
-    std::string identLevel(ident, ' ');
+namespace {
+
+const std::string indentation(256, ' ');
+
+const char digitPairs[] =
+    "00010203040506070809"
+    "10111213141516171819"
+    "20212223242526272829"
+    "30313233343536373839"
+    "40414243444546474849"
+    "50515253545556575859"
+    "60616263646566676869"
+    "70717273747576777879"
+    "80818283848586878889"
+    "90919293949596979899";
+
+const char hexDigits[] = "0123456789abcdef";
+
+void appendIndent(std::string& out, int count) {
+    while (count > 0) {
+        int chunk = std::min<int>(count, indentation.size());
+        out.append(indentation.data(), chunk);
+        count -= chunk;
+    }
+}
+
+void appendInt(std::string& out, int value) {
+    char buffer[16];
+    char* end = buffer + sizeof(buffer);
+    char* p = end;
+
+    unsigned int v = value < 0 ? 0u - static_cast<unsigned int>(value) : static_cast<unsigned int>(value);
+
+    while (v >= 100) {
+        unsigned int idx = (v % 100) * 2;
+        v /= 100;
+        *--p = digitPairs[idx + 1];
+        *--p = digitPairs[idx];
+    }
+
+    if (v >= 10) {
+        *--p = digitPairs[v * 2 + 1];
+        *--p = digitPairs[v * 2];
+    } else {
+        *--p = static_cast<char>('0' + v);
+    }
+
+    if (value < 0) {
+        *--p = '-';
+    }
+
+    out.append(p, end - p);
+}
+
+void appendFloat(std::string& out, float value) {
+    //json has no representation for nan and infinities
+    if (!std::isfinite(value)) {
+        out.append("null");
+        return;
+    }
+
+    char buffer[32];
+    int len = snprintf(buffer, sizeof(buffer), "%g", static_cast<double>(value));
+
+    //%g honours LC_NUMERIC, so patch back whatever decimal separator the locale gave us
+    for (int i = 0; i < len; ++i) {
+        char c = buffer[i];
+        if ((c < '0' || c > '9') && c != '-' && c != '+' && c != 'e') {
+            buffer[i] = '.';
+        }
+    }
+
+    out.append(buffer, len);
+}
+
+//true if any byte in the word is a control character, a quote or a backslash
+inline bool wordNeedsEscape(uint64_t word) {
+    const uint64_t ones = 0x0101010101010101ULL;
+    const uint64_t highs = 0x8080808080808080ULL;
+
+    uint64_t control = (word - ones * 0x20) & ~word & highs;
+    uint64_t quote = word ^ (ones * '"');
+    quote = (quote - ones) & ~quote & highs;
+    uint64_t backslash = word ^ (ones * '\\');
+    backslash = (backslash - ones) & ~backslash & highs;
+
+    return (control | quote | backslash) != 0;
+}
+
+inline bool charNeedsEscape(unsigned char c) {
+    return c < 0x20 || c == '"' || c == '\\';
+}
 
+void appendEscaped(std::string& out, const std::string& value) {
+    const char* data = value.data();
+    const size_t size = value.size();
+
+    out.push_back('"');
+
+    size_t runStart = 0;
+    size_t i = 0;
+
+    while (i < size) {
+        //skip clean words eight bytes at a time, they get copied in bulk below
+        while (i + sizeof(uint64_t) <= size) {
+            uint64_t word;
+            memcpy(&word, data + i, sizeof(word));
+            if (wordNeedsEscape(word)) {
+                break;
+            }
+            i += sizeof(word);
+        }
+
+        while (i < size && !charNeedsEscape(data[i])) {
+            ++i;
+        }
+
+        if (i == size) {
+            break;
+        }
+
+        out.append(data + runStart, i - runStart);
+
+        unsigned char c = data[i];
+        switch (c) {
+        case '"': out.append("\\\""); break;
+        case '\\': out.append("\\\\"); break;
+        case '\b': out.append("\\b"); break;
+        case '\f': out.append("\\f"); break;
+        case '\n': out.append("\\n"); break;
+        case '\r': out.append("\\r"); break;
+        case '\t': out.append("\\t"); break;
+        default: {
+            char escaped[] = { '\\', 'u', '0', '0', hexDigits[c >> 4], hexDigits[c & 0xf] };
+            out.append(escaped, sizeof(escaped));
+        }
+        break;
+        }
+
+        runStart = ++i;
+    }
+
+    out.append(data + runStart, size - runStart);
+    out.push_back('"');
+}
+
+}
+
+void JsonValue::write(std::string& out, bool prettyPrint, int ident) const
+{
     switch (item_val.type) {
     case json_bool:
-        out << (this->as_bool() ? "true" : "false");
+        out.append(this->as_bool() ? "true" : "false");
         break;
     case json_float:
-        out << this->as_float();
+        appendFloat(out, this->as_float());
         break;
     case json_int:
-        out << this->as_int();
+        appendInt(out, this->as_int());
         break;
     case json_list: {
         JsonValue::array::const_iterator iit = this->as_array().begin();
         JsonValue::array::const_iterator eend = this->as_array().end();
 
-        out << "[";
+        out.push_back('[');
         for (; iit != eend;) {
-            (*iit).toString(out, prettyPrint, ident + 1);
+            (*iit).write(out, prettyPrint, ident + 1);
 
             if (++iit == eend)
                 break;
 
-            out << ",";
-            if (prettyPrint) out << std::endl << identLevel;
+            out.push_back(',');
+            if (prettyPrint) {
+                out.push_back('\n');
+                appendIndent(out, ident);
+            }
         }
 
-        out << "]";
+        out.push_back(']');
     }
     break;
     case json_json: {
@@ -170,40 +324,60 @@ void JsonValue::toString(std::ostream& out, bool prettyPrint, int ident) const
         JsonValue::item_map::const_iterator it =  this->as_item_map().begin();
         JsonValue::item_map::const_iterator end = this->as_item_map().end();
 
-        out << "{";
-        if (prettyPrint) out << std::endl;
+        out.push_back('{');
+        if (prettyPrint) out.push_back('\n');
 
         for (; it != end;) {
-            out << identLevel;
+            if (prettyPrint) appendIndent(out, ident);
 
-            out << '"' << it->first << "\" : ";
-            it->second.toString(out, prettyPrint, ident + 1);
+            appendEscaped(out, it->first);
+            out.append(prettyPrint ? " : " : ":");
+            it->second.write(out, prettyPrint, ident + 1);
 
             if (++it == end) {
-                if (prettyPrint) out << std::endl;
+                if (prettyPrint) out.push_back('\n');
                 break;
             }
 
-            out << ",";
-            if (prettyPrint) out << std::endl;
+            out.push_back(',');
+            if (prettyPrint) out.push_back('\n');
+        }
+
+        if (prettyPrint) {
+            appendIndent(out, ident - 1);
+            out.append(" }");
+        } else {
+            out.push_back('}');
         }
-        if (prettyPrint) out << identLevel.substr(0, identLevel.length() - 1);
-        out << " }";
     }
     break;
     case json_null:
-        out << "null";
+        out.append("null");
         break;
     case json_string:
-        out << "\"" << this->as_string() << "\"";
+        appendEscaped(out, this->as_string());
+        break;
+    case json_raw:
+        out.append(item_val.value.string_val);
         break;
     };
 }
 
+void JsonValue::toString(std::string& out, bool prettyPrint) const
+{
+    write(out, prettyPrint, 1);
+}
+
+void JsonValue::toString(std::string& out, bool prettyPrint, int depth) const
+{
+    write(out, prettyPrint, depth + 1);
+}
 
 void JsonValue::toString(std::ostream& out, bool prettyPrint) const
 {
-    toString(out, prettyPrint, 1);
+    std::string buffer;
+    toString(buffer, prettyPrint);
+    out.write(buffer.data(), buffer.size());
 }
 
 //sob... c++ sucks A LOT sometimes...
@@ -328,7 +502,7 @@ void JsonValue::removeChild ( const std::string& childName ) {
 
 std::string JsonValue::toString() const
 {
-    std::stringstream ss;
-    this->toString(ss, true);
-    return ss.str();
+    std::string buffer;
+    this->toString(buffer, true);
+    return buffer;
 }
@@ -48,7 +48,8 @@ public:
         json_bool,
         json_list,
         json_json,
-        json_float
+        json_float,
+        json_raw
     };
 
     typedef std::shared_ptr< JsonValue > ptr;    
@@ -86,6 +87,7 @@ protected:
                     value.array_val.~vector();
                     break;
                 case json_string:
+                case json_raw:
                     value.string_val.~basic_string();                    
                     break;
                 default:
@@ -161,6 +163,7 @@ protected:
                     new (&value.array_val) array(other.value.array_val);
                     break;
                 case json_string:
+                case json_raw:
                     new (&value.string_val) std::string(other.value.string_val);
                     break;
                 default:
@@ -184,6 +187,17 @@ public:
         }
         return val;
     }
+
+    /**
+     * Wraps text that is already serialized json. It is written out verbatim,
+     * so it must have been produced at the depth it ends up in.
+     */
+    static JsonValue raw(std::string text) {
+        JsonValue val;
+        new (&val.item_val.value.string_val) std::string(std::move(text));
+        val.item_val.type = json_raw;
+        return val;
+    }
     
     JsonValue();  
     
@@ -265,6 +279,18 @@ public:
 
     void toString(std::ostream& out, bool prettyPrint = false) const;
 
+    /**
+     * Appends the serialized value to out. The buffer is never cleared, so
+     * callers can reserve a large string once and reuse it across documents.
+     */
+    void toString(std::string& out, bool prettyPrint = false) const;
+
+    /**
+     * Same as above, but indents as if the value was nested depth levels
+     * inside the document, for values spliced back later as raw().
+     */
+    void toString(std::string& out, bool prettyPrint, int depth) const;
+
     std::string toString() const;
     
     item_map::const_iterator begin() const;
@@ -283,7 +309,7 @@ public:
     friend std::ostream& operator<< (std::ostream &out, const JsonValue& item);
     
 private:
-    void toString(std::ostream& out, bool prettyPrint, int ident) const;
+    void write(std::string& out, bool prettyPrint, int ident) const;
     
     friend class JsonReader;
     
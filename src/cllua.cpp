@@ -21,29 +21,157 @@
 #include <algorithm>
 #include <functional>
 
+#include <clang/AST/Attr.h>
 #include <clang/AST/DeclCXX.h>
 #include <clang/AST/ASTConsumer.h>
 #include <clang/AST/ASTContext.h>
+#include <clang/AST/RecordLayout.h>
 #include <clang/AST/RecursiveASTVisitor.h>
+#include <clang/Basic/FileSystemStatCache.h>
 #include <clang/Basic/SourceManager.h>
 #include <clang/Frontend/CompilerInstance.h>
 #include <clang/Tooling/Tooling.h>
-#include <clang/Tooling/CommonOptionsParser.h>
+#include <clang/Tooling/CompilationDatabase.h>
 #include <clang/Frontend/FrontendPluginRegistry.h>
+#include <clang/Lex/Lexer.h>
+#include <clang/Lex/PPCallbacks.h>
+#include <clang/Lex/Preprocessor.h>
+#include <clang/Sema/Sema.h>
+#include <clang/Sema/SemaConsumer.h>
+#include <llvm/ADT/Hashing.h>
+#include <llvm/ADT/OwningPtr.h>
+#include <llvm/Support/CommandLine.h>
+#include <llvm/Support/MemoryBuffer.h>
+#include <llvm/Support/Regex.h>
 
 #include <unordered_map>
 #include <sstream>
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <chrono>
+#include <map>
+#include <set>
+#include <memory>
+#include <cerrno>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+
+#include <poll.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
 #include "JsonValue.hpp"
 
 using namespace clang;
 using namespace std;
 using namespace clang::tooling;
 
+static llvm::cl::opt<std::string> BuildPath(
+   "p", llvm::cl::desc("Build path, the directory holding compile_commands.json"));
+
+static llvm::cl::list<std::string> SourcePaths(
+   llvm::cl::Positional, llvm::cl::desc("<source0> [... <sourceN>]"), llvm::cl::ZeroOrMore);
+
+static llvm::cl::opt<bool> AllSources(
+   "all", llvm::cl::desc("Run every translation unit in the compilation database"));
+
+static llvm::cl::list<std::string> IncludeSources(
+   "include-tu", llvm::cl::desc("Only run sources whose path matches this glob, or regex when prefixed with re:"));
+
+static llvm::cl::list<std::string> ExcludeSources(
+   "exclude-tu", llvm::cl::desc("Skip sources whose path matches this glob, or regex when prefixed with re:"));
+
 static llvm::cl::opt<std::string> OutputPath(
    "o", llvm::cl::desc("Output file"), llvm::cl::Required);
 
+static llvm::cl::opt<bool> CompactOutput(
+   "compact", llvm::cl::desc("Write the output json without indentation"));
+
+static llvm::cl::opt<std::string> DepfilePath(
+   "MF", llvm::cl::desc("Write a make style depfile listing the files the output depends on"));
+
+static llvm::cl::opt<bool> StreamOutput(
+   "ndjson", llvm::cl::desc("Write one json record per line as each translation unit finishes"));
+
+static llvm::cl::opt<bool> TypeTable(
+   "type-table", llvm::cl::desc("Emit each type once in a top level \"types\" table and reference it by index"));
+
+static llvm::cl::opt<unsigned int> Jobs(
+   "j", llvm::cl::desc("Parse translation units in this many worker processes, a crashing unit only takes its worker down"), llvm::cl::init(0));
+
+static llvm::cl::opt<unsigned int> MaxRetries(
+   "retries", llvm::cl::desc("How many times a unit is retried after its worker crashed or timed out"), llvm::cl::init(1));
+
+static llvm::cl::opt<unsigned int> TranslationUnitTimeout(
+   "tu-timeout", llvm::cl::desc("Kill a worker after it spent this many seconds on one unit, 0 disables"), llvm::cl::init(0));
+
+static llvm::cl::opt<std::string> TimingsPath(
+   "timings", llvm::cl::desc("File with per unit parse times, read to schedule the slowest units first and updated afterwards"));
+
+static llvm::cl::opt<unsigned int> SerializeThreads(
+   "serialize-threads", llvm::cl::desc("Threads used to serialize the class records, 0 uses every core"), llvm::cl::init(0));
+
+static llvm::cl::opt<bool> UseFileCache(
+   "file-cache", llvm::cl::desc("Keep header contents and stat results in memory and share them between translation units"));
+
+static llvm::cl::opt<bool> Prefilter(
+   "prefilter", llvm::cl::desc("With -M, raw lex the include closure of each unit first and skip the units that cannot contain a matching class"));
+
+static llvm::cl::opt<std::string> ClassIdsPath(
+   "class-ids", llvm::cl::desc("File mapping qualified names to class ids, read to keep ids stable between runs and updated afterwards"));
+
+static llvm::cl::opt<std::string> LuaOutputPath(
+   "lua-output", llvm::cl::desc("Also write Lua C API bindings for the extracted classes to this C++ file"));
+
+static llvm::cl::opt<std::string> LuaModule(
+   "lua-module", llvm::cl::desc("Name of the module opened by the generated luaopen_ function"), llvm::cl::init("bindings"));
+
 static llvm::cl::list< std::string> IncludeMatches ("M", llvm::cl::desc("Comma separated list of strings to match when parsing a record definition."));
 
+std::string normalizePath(const std::string& path) {
+    std::string full = path;
+
+    if (full.empty() || full[0] != '/') {
+        char cwd[4096];
+        if (getcwd(cwd, sizeof(cwd))) {
+            full = std::string(cwd) + "/" + full;
+        }
+    }
+
+    std::vector< std::string > parts;
+    size_t start = 0;
+
+    while (start <= full.size()) {
+        size_t end = full.find('/', start);
+        if (end == std::string::npos) {
+            end = full.size();
+        }
+
+        std::string part = full.substr(start, end - start);
+        if (part == "..") {
+            if (!parts.empty()) {
+                parts.pop_back();
+            }
+        } else if (!part.empty() && part != ".") {
+            parts.push_back(part);
+        }
+
+        start = end + 1;
+    }
+
+    std::string normalized;
+    for (const std::string& part : parts) {
+        normalized += "/" + part;
+    }
+
+    return normalized.empty() ? "/" : normalized;
+}
+
 std::string getCanonicalTypeFromQualifiedType(const QualType& type) {
     LangOptions lo;
     PrintingPolicy pp(lo);
@@ -66,6 +194,9 @@ struct CxxType {
   std::string ns;
   std::string type;
   std::string spelling;
+
+  //position in the "types" table when -type-table is on
+  int index = -1;
 };
 
 struct MethodParameter {
@@ -73,6 +204,8 @@ struct MethodParameter {
   bool isPointer = false;
   bool isReference = false;
   bool isConst = false;
+  //for pointers, whether the pointee is const; isConst is the pointer's own qualifier
+  bool isPointeeConst = false;
   
   std::string name;
 };
@@ -83,12 +216,57 @@ struct MethodDefinition {
         constructor
     };
     
+    //inline bodies simple enough for bindings to replace the call
+    enum class AccessorKind {
+        none,
+        getter,
+        setter,
+        constant
+    };
+    
     std::vector<MethodParameter> parameters;    
+    //leading parameters without a default argument
+    unsigned int requiredParameters = 0;
     std::string name;
     bool isVirtual = false;
+    bool isFinal = false;
+    bool isPure = false;
+    bool isNoexcept = false;
+    bool isDeleted = false;
+    //filled in once the whole corpus is known, see markOverriddenMethods
+    bool isOverridden = false;
+
+    //identifies the method across classes, overrides holds the keys of the methods it overrides
+    std::string key;
+    std::vector<std::string> overrides;
     
     MethodParameter retType;    
     FuncType functionType = FuncType::method;
+
+    AccessorKind accessor = AccessorKind::none;
+    std::string accessorField;
+    //byte offset of the field inside the object, -1 when the layout is unknown
+    long long accessorOffset = -1;
+    std::string accessorValue;
+};
+
+struct FieldDefinition {
+    //type, qualifiers and name of the field
+    MethodParameter type;
+    long long offset = 0;
+
+    bool isBitField = false;
+    //bitfields are addressed in bits from the start of the object
+    unsigned int bitOffset = 0;
+    unsigned int bitWidth = 0;
+};
+
+//where an ancestor subobject lives inside the complete object
+struct BaseOffset {
+    std::string qualifiedName;
+    long long offset = 0;
+    //virtual bases only sit at this offset when this class is the dynamic type
+    bool isVirtual = false;
 };
 
 class ClassDefinition {
@@ -97,12 +275,42 @@ public:
     std::vector< MethodDefinition > methods;
     
     std::set < std::string > dependencies;
-    std::set < ClassDefinition* > bases;
+    std::vector < ClassDefinition* > bases;
+    std::vector < BaseOffset > upcasts;
+    std::vector < FieldDefinition > fields;
+
+    //lets bindings store small objects inline and skip finalizers
+    bool isTriviallyCopyable = false;
+    bool isTriviallyDestructible = false;
+    bool isStandardLayout = false;
+    bool isNothrowMoveConstructible = false;
+    bool hasDefaultConstructor = false;
+    //public and not deleted, what bindings need to own, copy or return objects by value
+    bool isDestructible = false;
+    bool isCopyConstructible = false;
+    bool isMoveConstructible = false;
+
+    //layouts are only known for non dependent types
+    bool hasLayout = false;
+    long long size = 0;
+    long long alignment = 0;
      
     std::string name;
     std::string qualifiedName;
+    std::string file;
     unsigned int classID = 0;
     bool processed = false;
+    bool isFinal = false;
+    bool isAbstract = false;
+    //whether code outside the defining unit can name the class: external linkage, public all the way out, not in a .cpp
+    bool hasExternalLinkage = false;
+    bool isAccessible = false;
+    bool isInMainFile = false;
+
+    //preorder interval over the tree of first bases, plus the ancestors it does not cover
+    unsigned int rangeBegin = 0;
+    unsigned int rangeEnd = 0;
+    std::vector< unsigned int > secondaryAncestors;
     
     ClassDefinition(const std::string& _name, const std::string& _qualifiedName) : name(_name), qualifiedName(_qualifiedName) {
     }
@@ -162,6 +370,10 @@ MethodParameter makeParameter(const QualType& param) {
     cxxParam.isConst = param.isConstQualified();
     cxxParam.type =  makeType(param);
 
+    if (param->isPointerType()) {
+        cxxParam.isPointeeConst = param->getPointeeType().isConstQualified();
+    }
+
     if (param->isReferenceType()) {
         cxxParam.isConst = param->getPointeeType().isConstQualified();
     }
@@ -178,12 +390,154 @@ void processDependency(MethodParameter& mp, const QualType& qualType, ClassDefin
     }
 }
 
+//the field behind a plain this->field expression
+const FieldDecl* thisMember(const Expr* expr) {
+    const MemberExpr* member = dyn_cast<MemberExpr>(expr->IgnoreParenImpCasts());
+    if (!member || !isa<CXXThisExpr>(member->getBase()->IgnoreParenImpCasts())) {
+        return nullptr;
+    }
+
+    const FieldDecl* field = dyn_cast<FieldDecl>(member->getMemberDecl());
+    return field && !field->isBitField() ? field : nullptr;
+}
+
+long long fieldOffset(const FieldDecl* field, const ClassDefinition& cdef, ASTContext& context) {
+    const RecordDecl* parent = field->getParent();
+    if (parent->isDependentType() || parent->isInvalidDecl()) {
+        return -1;
+    }
+
+    long long offset = context.getASTRecordLayout(parent).getFieldOffset(field->getFieldIndex()) / context.getCharWidth();
+
+    //inherited fields sit inside the base subobject
+    std::string owner = getCanonicalTypeFromQualifiedType(QualType(parent->getTypeForDecl(), 0));
+    if (owner == cdef.qualifiedName) {
+        return offset;
+    }
+
+    for (const auto& upcast : cdef.upcasts) {
+        if (upcast.qualifiedName == owner && !upcast.isVirtual) {
+            return upcast.offset + offset;
+        }
+    }
+
+    return -1;
+}
+
+/**
+ * Recognizes inline bodies that are a single read of a field, a single
+ * assignment of the parameter to a field, or return a constant expression.
+ * Virtual methods are left alone, an override could do anything.
+ */
+void detectAccessor(MethodDefinition& md, const CXXMethodDecl& decl, ClassDefinition& cdef, ASTContext& context) {
+    const FunctionDecl* definition = nullptr;
+    const Stmt* body = decl.getBody(definition);
+
+    if (!body || !definition->isInlined() || decl.isVirtual()) {
+        return;
+    }
+
+    const CompoundStmt* compound = dyn_cast<CompoundStmt>(body);
+    if (!compound || compound->size() != 1) {
+        return;
+    }
+
+    const Stmt* stmt = compound->body_back();
+
+    if (const ReturnStmt* ret = dyn_cast<ReturnStmt>(stmt)) {
+        const Expr* value = ret->getRetValue();
+        if (!value) {
+            return;
+        }
+
+        QualType resultType = decl.getResultType().getNonReferenceType();
+
+        if (decl.param_size() == 0 && !decl.isStatic()) {
+            const FieldDecl* field = thisMember(value);
+            if (field && context.hasSameUnqualifiedType(field->getType(), resultType)) {
+                md.accessor = MethodDefinition::AccessorKind::getter;
+                md.accessorField = field->getNameAsString();
+                md.accessorOffset = fieldOffset(field, cdef, context);
+                return;
+            }
+        }
+
+        if (value->isValueDependent() || value->isTypeDependent() || decl.getResultType()->isReferenceType()) {
+            return;
+        }
+
+        llvm::APSInt integer;
+        Expr::EvalResult result;
+
+        if (value->EvaluateAsInt(integer, context)) {
+            md.accessor = MethodDefinition::AccessorKind::constant;
+            if (resultType->isBooleanType()) {
+                md.accessorValue = integer.getBoolValue() ? "true" : "false";
+            } else {
+                md.accessorValue = integer.toString(10);
+            }
+        } else if (value->EvaluateAsRValue(result, context) && result.Val.isFloat()) {
+            std::ostringstream formatted;
+            formatted.precision(17);
+            formatted << result.Val.getFloat().convertToDouble();
+
+            md.accessor = MethodDefinition::AccessorKind::constant;
+            md.accessorValue = formatted.str();
+        }
+
+        return;
+    }
+
+    const BinaryOperator* assign = dyn_cast<BinaryOperator>(stmt);
+    if (!assign || assign->getOpcode() != BO_Assign || decl.param_size() != 1 || decl.isStatic()) {
+        return;
+    }
+
+    const FieldDecl* field = thisMember(assign->getLHS());
+    const DeclRefExpr* ref = dyn_cast<DeclRefExpr>(assign->getRHS()->IgnoreParenImpCasts());
+
+    if (field && ref && ref->getDecl() == decl.getParamDecl(0)
+            && context.hasSameUnqualifiedType(field->getType(), decl.getParamDecl(0)->getType().getNonReferenceType())) {
+        md.accessor = MethodDefinition::AccessorKind::setter;
+        md.accessorField = field->getNameAsString();
+        md.accessorOffset = fieldOffset(field, cdef, context);
+    }
+}
+
+//constructors always do more than they show
+void detectAccessor(MethodDefinition& md, const CXXConstructorDecl& decl, ClassDefinition& cdef, ASTContext& context) {
+}
+
+std::string methodKey(const CXXMethodDecl* decl) {
+    std::string key = getCanonicalTypeFromQualifiedType(QualType(decl->getParent()->getTypeForDecl(), 0));
+    key += "::" + decl->getNameAsString() + "(";
+
+    for (unsigned int i = 0; i < decl->getNumParams(); ++i) {
+        key += (i ? "," : "") + decl->getParamDecl(i)->getType().getCanonicalType().getAsString();
+    }
+
+    return key + (decl->isConst() ? ") const" : ")");
+}
+
 template <typename dc>
-MethodDefinition createMethod(MethodDefinition::FuncType ft, const dc& decl , ClassDefinition& cdef) {
+MethodDefinition createMethod(MethodDefinition::FuncType ft, const dc& decl , ClassDefinition& cdef, ASTContext& context) {
     MethodDefinition md;
     md.name = decl.getNameAsString();
     md.functionType = ft;
     md.isVirtual = decl.isVirtual();
+    md.isFinal = decl.template hasAttr<FinalAttr>();
+    md.isPure = decl.isPure();
+    md.isDeleted = decl.isDeleted();
+    md.requiredParameters = decl.getMinRequiredArguments();
+    md.key = methodKey(&decl);
+
+    for (auto overridden = decl.begin_overridden_methods(); overridden != decl.end_overridden_methods(); ++overridden) {
+        md.overrides.push_back(methodKey(*overridden));
+    }
+
+    if (const FunctionProtoType* proto = decl.getType()->template getAs<FunctionProtoType>()) {
+        md.isNoexcept = proto->isNothrow(context);
+    }
     
     for (auto param = decl.param_begin(); param != decl.param_end(); ++param) {
         QualType paramType = (*param)->getType();
@@ -200,6 +554,8 @@ MethodDefinition createMethod(MethodDefinition::FuncType ft, const dc& decl , Cl
         md.retType =  makeParameter(retType);    
         processDependency(md.retType, retType, cdef);
     }
+
+    detectAccessor(md, decl, cdef, context);
     
     return md;
 }
@@ -238,30 +594,61 @@ public:
 
         ClassDefinition* clazz = classMapping[qualname];      
 
+        //headers are seen once per translation unit including them, the definition never changes
+        if (clazz->processed) {
+            return true;
+        }
+
+        clazz->processed = true;
+        extracted.push_back(clazz);
+
+        SourceLocation location = sourceManager.getExpansionLoc(record->getLocation());
+        if (const FileEntry* entry = sourceManager.getFileEntryForID(sourceManager.getFileID(location))) {
+            //the name is relative to the unit's compile directory, which is the current one right now
+            clazz->file = normalizePath(entry->getName());
+        }
+
+        clazz->isFinal = record->hasAttr<FinalAttr>();
+        clazz->isAbstract = record->isAbstract();
+        clazz->hasExternalLinkage = record->getLinkage() == ExternalLinkage;
+        clazz->isInMainFile = sourceManager.isFromMainFile(location);
+
+        //nested classes are only reachable when every enclosing declaration is public
+        clazz->isAccessible = true;
+        for (const Decl* decl = record; isa<CXXRecordDecl>(decl->getDeclContext()); decl = cast<Decl>(decl->getDeclContext())) {
+            if (decl->getAccess() != AS_public) {
+                clazz->isAccessible = false;
+                break;
+            }
+        }
+
         if (record->getDescribedClassTemplate()) {
             //we have a templated class, mark that
             classMapping[qualname]->isTemplated = true;
         }
 
         bool hasConstructors = false;
+        bool listedDefaultConstructor = false;
         //parsing constructors
         for(auto it = record->ctor_begin(); it != record->ctor_end(); ++it) {
             if (it->getAccess() != AS_public && it->getAccess() != AS_none) {
                 continue;
             }
             
-            clazz->methods.push_back(createMethod<CXXConstructorDecl>(MethodDefinition::FuncType::constructor, **it, *clazz));
+            clazz->methods.push_back(createMethod<CXXConstructorDecl>(MethodDefinition::FuncType::constructor, **it, *clazz, *context));
             hasConstructors = true;
+            listedDefaultConstructor = listedDefaultConstructor || it->isDefaultConstructor();
         }
+
+        computeTraits(*clazz, record);
         
          //if the default constructor is undeclared, manually create one with no parameters
-        if (false) {
-            if (!record->hasDeclaredDefaultConstructor()) {
-                MethodDefinition md;
-                md.functionType = MethodDefinition::FuncType::constructor;                
-                
-                clazz->methods.push_back(md);
-            }
+        if (clazz->hasDefaultConstructor && !listedDefaultConstructor && !record->isAbstract()) {
+            MethodDefinition md;
+            md.name = record->getNameAsString();
+            md.functionType = MethodDefinition::FuncType::constructor;                
+            
+            clazz->methods.push_back(md);
         }
         
         for (auto it = record->bases_begin(); it != record->bases_end(); ++it) {
@@ -271,10 +658,50 @@ public:
                 classMapping[qualType] = new ClassDefinition(qualType, qualType);                
             }
 
-            clazz->bases.insert(classMapping[qualType]);
+            if (std::find(clazz->bases.begin(), clazz->bases.end(), classMapping[qualType]) == clazz->bases.end()) {
+                clazz->bases.push_back(classMapping[qualType]);
+            }
             clazz->dependencies.insert(qualType);
         }
 
+        //layouts only exist for concrete types
+        if (!record->isDependentType() && !record->isInvalidDecl()) {
+            const ASTRecordLayout& layout = context->getASTRecordLayout(record);
+
+            clazz->hasLayout = true;
+            clazz->size = layout.getSize().getQuantity();
+            clazz->alignment = layout.getAlignment().getQuantity();
+
+            for (auto field = record->field_begin(); field != record->field_end(); ++field) {
+                if (field->getAccess() != AS_public || field->getName().empty()) {
+                    continue;
+                }
+
+                FieldDefinition fd;
+                fd.type = makeParameter(field->getType());
+                fd.type.name = field->getNameAsString();
+
+                uint64_t bits = layout.getFieldOffset(field->getFieldIndex());
+                fd.offset = bits / context->getCharWidth();
+
+                if (field->isBitField()) {
+                    fd.isBitField = true;
+                    fd.bitOffset = bits;
+                    fd.bitWidth = field->getBitWidthValue(*context);
+                }
+
+                processDependency(fd.type, field->getType(), *clazz);
+                clazz->fields.push_back(fd);
+            }
+
+            std::set< std::string > ambiguous;
+            collectUpcasts(*clazz, context->getASTRecordLayout(record), record, CharUnits::Zero(), false, ambiguous);
+
+            clazz->upcasts.erase(std::remove_if(clazz->upcasts.begin(), clazz->upcasts.end(), [&ambiguous](const BaseOffset& upcast) {
+                return ambiguous.count(upcast.qualifiedName) > 0;
+            }), clazz->upcasts.end());
+        }
+
         //parsing methods
         for (auto method = record->method_begin(); method != record->method_end(); ++method) {
             if ( method->getAccess() != AS_public 
@@ -282,23 +709,147 @@ public:
                 continue;
             }
             
-            clazz->methods.push_back(createMethod<CXXMethodDecl>(MethodDefinition::FuncType::method, **method, *clazz));
+            clazz->methods.push_back(createMethod<CXXMethodDecl>(MethodDefinition::FuncType::method, **method, *clazz, *context));
         }
         
         return true;
     }
 
+    const std::vector< ClassDefinition* >& extractedClasses() const {
+        return extracted;
+    }
+
+    void setContext(ASTContext* ctx) {
+        context = ctx;
+    }
+
+    void setSema(Sema* _sema) {
+        sema = _sema;
+    }
+
 private:
+    void computeTraits(ClassDefinition& clazz, const CXXRecordDecl* record) {
+        clazz.isTriviallyCopyable = record->isTriviallyCopyable();
+        clazz.isTriviallyDestructible = record->hasTrivialDestructor();
+        clazz.isStandardLayout = record->isStandardLayout();
+
+        bool usableDefault = false;
+        const CXXConstructorDecl* move = nullptr;
+        const CXXConstructorDecl* copy = nullptr;
+
+        for (auto it = record->ctor_begin(); it != record->ctor_end(); ++it) {
+            bool usable = it->getAccess() == AS_public && !it->isDeleted();
+
+            if (it->isDefaultConstructor()) {
+                usableDefault = usableDefault || usable;
+            } else if (it->isMoveConstructor() && usable) {
+                move = *it;
+            } else if (it->isCopyConstructor() && usable) {
+                copy = *it;
+            }
+        }
+
+        //implicit members are declared lazily, let Sema declare them so deleted ones and exception specs are known
+        if (sema && !record->isDependentContext()) {
+            CXXRecordDecl* decl = const_cast< CXXRecordDecl* >(record);
+
+            const CXXConstructorDecl* ctor = sema->LookupDefaultConstructor(decl);
+            clazz.hasDefaultConstructor = ctor && !ctor->isDeleted() && ctor->getAccess() == AS_public;
+
+            const CXXDestructorDecl* dtor = sema->LookupDestructor(decl);
+            clazz.isDestructible = dtor && !dtor->isDeleted() && dtor->getAccess() == AS_public;
+
+            copy = sema->LookupCopyingConstructor(decl, Qualifiers::Const);
+            clazz.isCopyConstructible = copy && !copy->isDeleted() && copy->getAccess() == AS_public;
+
+            //picks the copy constructor when there is no usable move one, like returning by value would
+            move = sema->LookupMovingConstructor(decl, 0);
+            if (move && (move->isDeleted() || move->getAccess() != AS_public)) {
+                move = nullptr;
+            }
+            clazz.isMoveConstructible = move != nullptr;
+            copy = nullptr;
+        } else {
+            //templates can't be asked, an undeclared default constructor may still turn out deleted
+            clazz.hasDefaultConstructor = usableDefault;
+
+            const CXXDestructorDecl* dtor = record->getDestructor();
+            clazz.isDestructible = !dtor || (!dtor->isDeleted() && dtor->getAccess() == AS_public);
+            clazz.isCopyConstructible = copy || record->needsImplicitCopyConstructor();
+            clazz.isMoveConstructible = move || clazz.isCopyConstructible;
+        }
+
+        if (record->hasTrivialMoveConstructor()
+                || (record->hasTrivialCopyConstructor() && !record->hasUserDeclaredMoveConstructor())) {
+            clazz.isNothrowMoveConstructible = true;
+        } else if (const CXXConstructorDecl* ctor = move ? move : copy) {
+            const FunctionProtoType* proto = ctor->getType()->getAs<FunctionProtoType>();
+            if (proto && sema) {
+                proto = sema->ResolveExceptionSpec(ctor->getLocation(), proto);
+            }
+            clazz.isNothrowMoveConstructible = proto && proto->isNothrow(*context);
+        }
+    }
+
+    //records the offset of every ancestor of current, which sits at offset inside the complete object
+    void collectUpcasts(ClassDefinition& clazz, const ASTRecordLayout& complete, const CXXRecordDecl* current,
+                        CharUnits offset, bool viaVirtual, std::set< std::string >& ambiguous) {
+        const ASTRecordLayout& layout = context->getASTRecordLayout(current);
+
+        for (auto it = current->bases_begin(); it != current->bases_end(); ++it) {
+            const CXXRecordDecl* base = it->getType()->getAsCXXRecordDecl();
+            if (!base || !(base = base->getDefinition())) {
+                continue;
+            }
+
+            BaseOffset upcast;
+            upcast.qualifiedName = getCanonicalTypeFromQualifiedType(it->getType());
+            upcast.isVirtual = viaVirtual || it->isVirtual();
+
+            CharUnits baseOffset = it->isVirtual() ? complete.getVBaseClassOffset(base)
+                                                   : offset + layout.getBaseClassOffset(base);
+            upcast.offset = baseOffset.getQuantity();
+
+            auto seen = std::find_if(clazz.upcasts.begin(), clazz.upcasts.end(), [&upcast](const BaseOffset& other) {
+                return other.qualifiedName == upcast.qualifiedName;
+            });
+
+            if (seen == clazz.upcasts.end()) {
+                clazz.upcasts.push_back(upcast);
+            } else if (seen->offset != upcast.offset) {
+                //the same base reached through distinct subobjects, there's no single answer
+                ambiguous.insert(upcast.qualifiedName);
+            }
+
+            collectUpcasts(clazz, complete, base, baseOffset, upcast.isVirtual, ambiguous);
+        }
+    }
+
     SourceManager& sourceManager;
+    ASTContext* context = nullptr;
+    Sema* sema = nullptr;
+    std::vector< ClassDefinition* > extracted;
 };
 
-class LuaBinderConsumer : public ASTConsumer {
+void translationUnitDone(const std::string& file, const std::vector< ClassDefinition* >& classes);
+
+class LuaBinderConsumer : public SemaConsumer {
 public:
-    LuaBinderConsumer (SourceManager& manager) : Visitor(manager) {
+    LuaBinderConsumer (SourceManager& manager, const std::string& file) : Visitor(manager), inFile(file) {
+    }
+
+    virtual void InitializeSema(Sema& sema) {
+        Visitor.setSema(&sema);
+    }
+
+    virtual void ForgetSema() {
+        Visitor.setSema(nullptr);
     }
 
     virtual void HandleTranslationUnit ( clang::ASTContext &Context ) {
+        Visitor.setContext(&Context);
         Visitor.TraverseDecl ( Context.getTranslationUnitDecl() );
+        translationUnitDone(inFile, Visitor.extractedClasses());
     }
 
     virtual ~LuaBinderConsumer() {
@@ -306,45 +857,701 @@ public:
 
 private:
     LuaBuilderASTVisitor Visitor;
+    std::string inFile;
+};
+
+/**
+ * Run wide cache of stat results and header contents. Every translation unit
+ * includes mostly the same headers, with the cache each of them is read from
+ * disk once and then served from memory to the following units.
+ */
+struct FileCache {
+    struct Status {
+        bool exists;
+        struct stat buf;
+    };
+
+    std::unordered_map< std::string, Status > stats;
+    //keyed by device and inode, the same header reached through any path or link is one entry
+    std::map< std::pair< dev_t, ino_t >, const llvm::MemoryBuffer* > contents;
+
+    size_t statHits = 0;
+    size_t statMisses = 0;
+    size_t contentHits = 0;
+    size_t contentMisses = 0;
+
+    void report(std::ostream& out) const {
+        size_t lookups = contentHits + contentMisses;
+        out << "clang-lua-generator: file cache served " << contentHits << " of " << lookups << " headers";
+        if (lookups) {
+            out << " (" << (100 * contentHits / lookups) << "%)";
+        }
+        out << ", " << statHits << " of " << (statHits + statMisses) << " stats, "
+            << contents.size() << " unique files" << std::endl;
+    }
+};
+
+FileCache fileCache;
+
+//ClangTool runs each unit from its compile directory, so relative names only mean something together with it
+std::string unitDirectory;
+
+std::string absolutePath(const char* path) {
+    return path[0] == '/' ? std::string(path) : unitDirectory + "/" + path;
+}
+
+class SharedStatCache : public FileSystemStatCache {
+protected:
+    virtual LookupResult getStat(const char* path, struct stat& statBuf, int* fileDescriptor) {
+        std::string key = absolutePath(path);
+        auto found = fileCache.stats.find(key);
+
+        if (found != fileCache.stats.end()) {
+            fileCache.statHits++;
+            if (!found->second.exists) {
+                return CacheMissing;
+            }
+            statBuf = found->second.buf;
+            return CacheExists;
+        }
+
+        fileCache.statMisses++;
+        LookupResult result = statChained(path, statBuf, fileDescriptor);
+
+        FileCache::Status& status = fileCache.stats[key];
+        status.exists = result == CacheExists;
+        status.buf = statBuf;
+
+        return result;
+    }
+};
+
+//swaps in the cached contents right before a header is entered
+class FileCacheCallbacks : public PPCallbacks {
+public:
+    FileCacheCallbacks(SourceManager& manager, std::set< const FileEntry* >& _overridden)
+        : sourceManager(manager), overridden(_overridden) {
+    }
+
+    virtual void InclusionDirective(SourceLocation hashLoc, const Token& includeTok, StringRef fileName,
+                                    bool isAngled, CharSourceRange filenameRange, const FileEntry* file,
+                                    StringRef searchPath, StringRef relativePath, const Module* imported) {
+        if (!file || overridden.count(file) || sourceManager.isFileOverridden(file)) {
+            return;
+        }
+
+        auto found = fileCache.contents.find(std::make_pair(file->getDevice(), file->getInode()));
+        if (found == fileCache.contents.end()) {
+            fileCache.contentMisses++;
+            return;
+        }
+
+        fileCache.contentHits++;
+        sourceManager.overrideFileContents(file, found->second, true);
+        overridden.insert(file);
+    }
+
+private:
+    SourceManager& sourceManager;
+    std::set< const FileEntry* >& overridden;
 };
 
+//every file a unit read, for the depfile, like -MD would list them
+std::set< std::string > inputFiles;
+
 class BuildLuaBindingsAction : public ASTFrontendAction {
 public:
 
     BuildLuaBindingsAction() { }
 
+    virtual bool BeginSourceFileAction(clang::CompilerInstance& Compiler, llvm::StringRef InFile) {
+        char cwd[4096];
+        unitDirectory = getcwd(cwd, sizeof(cwd)) ? cwd : ".";
+
+        if (!UseFileCache) {
+            return true;
+        }
+
+        //the file manager may outlive the unit, the cache is unchained again when it ends
+        statCache = new SharedStatCache;
+        Compiler.getFileManager().addStatCache(statCache);
+
+        overridden.clear();
+        Compiler.getPreprocessor().addPPCallbacks(new FileCacheCallbacks(Compiler.getSourceManager(), overridden));
+        return true;
+    }
+
+    //keep every file this unit had to read itself for the units that follow
+    virtual void EndSourceFileAction() {
+        SourceManager& manager = getCompilerInstance().getSourceManager();
+
+        if (!DepfilePath.empty()) {
+            for (auto it = manager.fileinfo_begin(); it != manager.fileinfo_end(); ++it) {
+                inputFiles.insert(normalizePath(absolutePath(it->first->getName())));
+            }
+        }
+
+        if (!UseFileCache) {
+            return;
+        }
+
+        getCompilerInstance().getFileManager().removeStatCache(statCache);
+        statCache = nullptr;
+
+        for (auto it = manager.fileinfo_begin(); it != manager.fileinfo_end(); ++it) {
+            const llvm::MemoryBuffer* buffer = it->second->getRawBuffer();
+
+            if (!buffer || overridden.count(it->first)) {
+                continue;
+            }
+
+            auto key = std::make_pair(it->first->getDevice(), it->first->getInode());
+            if (fileCache.contents.count(key)) {
+                continue;
+            }
+
+            fileCache.contents[key] = llvm::MemoryBuffer::getMemBufferCopy(buffer->getBuffer(), it->first->getName());
+        }
+    }
+
     virtual clang::ASTConsumer *CreateASTConsumer (
         clang::CompilerInstance &Compiler, llvm::StringRef InFile ) {
         Compiler.getDiagnostics().setSuppressAllDiagnostics(true);
-        tool = new LuaBinderConsumer(Compiler.getSourceManager());
+        tool = new LuaBinderConsumer(Compiler.getSourceManager(), InFile.str());
         return tool;
     }
 
     LuaBinderConsumer* tool;
+
+private:
+    std::set< const FileEntry* > overridden;
+    SharedStatCache* statCache = nullptr;
 };
 
-gdx::JsonValue dumpType(const CxxType* type) {
-    return {
-        "namespace", type->ns,
-        "type" , type->type,
-        "spelling", type->spelling
-    };    
-}
+std::map< std::string, unsigned int > knownClassIds;
+unsigned int nextClassId = 1;
 
-gdx::JsonValue dumpParam(const MethodParameter& param) {
-    gdx::JsonValue tp = dumpType(param.type);
-    tp += {
-      "name" , param.name,
-      "is_const" , param.isConst,
-      "is_pointer", param.isPointer,
-      "is_ref", param.isReference
-    };
-    
-    return tp;    
+//ids handed out by earlier runs stay with their class
+void loadClassIds() {
+    std::ifstream in(ClassIdsPath.c_str());
+    unsigned int id;
+    std::string qualname;
+
+    while (in >> id && std::getline(in >> std::ws, qualname)) {
+        knownClassIds[qualname] = id;
+        nextClassId = std::max(nextClassId, id + 1);
+    }
 }
 
-std::string dump(gdx::JsonValue& classDef, const ClassDefinition& def) {
-    std::stringstream ss;
+void saveClassIds() {
+    std::map< unsigned int, std::string > byId;
+    for (const auto& known : knownClassIds) {
+        byId[known.second] = known.first;
+    }
+
+    std::ofstream out(ClassIdsPath.c_str());
+    for (const auto& entry : byId) {
+        out << entry.first << "\t" << entry.second << "\n";
+    }
+}
+
+unsigned int classId(ClassDefinition* def) {
+    if (def->classID == 0) {
+        auto known = knownClassIds.find(def->qualifiedName);
+        if (known != knownClassIds.end()) {
+            def->classID = known->second;
+        } else {
+            def->classID = knownClassIds[def->qualifiedName] = nextClassId++;
+        }
+    }
+    return def->classID;
+}
+
+bool overridesResolved = false;
+
+//closed world: a method counts as overridden only when an extracted class overrides it
+void markOverriddenMethods() {
+    std::set< std::string > overridden;
+
+    for (const auto& cls : classMapping) {
+        for (const auto& method : cls.second->methods) {
+            overridden.insert(method.overrides.begin(), method.overrides.end());
+        }
+    }
+
+    for (const auto& cls : classMapping) {
+        for (auto& method : cls.second->methods) {
+            method.isOverridden = overridden.count(method.key) > 0;
+        }
+    }
+
+    overridesResolved = true;
+}
+
+std::vector< ClassDefinition* > sortedClasses() {
+    std::vector< ClassDefinition* > classes;
+    for (const auto& cls : classMapping) {
+        classes.push_back(cls.second);
+    }
+
+    std::sort(classes.begin(), classes.end(), [](const ClassDefinition* a, const ClassDefinition* b) {
+        return a->qualifiedName < b->qualifiedName;
+    });
+
+    return classes;
+}
+
+void collectAncestors(const ClassDefinition* def, std::set< const ClassDefinition* >& ancestors) {
+    for (const ClassDefinition* base : def->bases) {
+        if (ancestors.insert(base).second) {
+            collectAncestors(base, ancestors);
+        }
+    }
+}
+
+//new classes get the next ids in qualified name order, so a fresh run is dense and sorted
+void assignClassIds() {
+    for (ClassDefinition* def : sortedClasses()) {
+        classId(def);
+    }
+}
+
+/**
+ * Numbers the classes in preorder over the forest formed by each class and
+ * its first base. A class is then a T when its rangeBegin lies inside T's
+ * range, or when T is one of its secondaryAncestors.
+ */
+void computeTypeRanges() {
+    std::vector< ClassDefinition* > classes = sortedClasses();
+    std::unordered_map< const ClassDefinition*, std::vector< ClassDefinition* > > children;
+    std::vector< ClassDefinition* > roots;
+
+    for (ClassDefinition* def : classes) {
+        if (def->bases.empty()) {
+            roots.push_back(def);
+        } else {
+            children[def->bases.front()].push_back(def);
+        }
+    }
+
+    unsigned int counter = 0;
+    std::function< void(ClassDefinition*) > number = [&](ClassDefinition* def) {
+        def->rangeBegin = ++counter;
+        for (ClassDefinition* child : children[def]) {
+            number(child);
+        }
+        def->rangeEnd = counter;
+    };
+
+    for (ClassDefinition* root : roots) {
+        number(root);
+    }
+
+    for (ClassDefinition* def : classes) {
+        std::set< const ClassDefinition* > ancestors;
+        collectAncestors(def, ancestors);
+
+        for (const ClassDefinition* primary = def; !primary->bases.empty(); primary = primary->bases.front()) {
+            ancestors.erase(primary->bases.front());
+        }
+
+        def->secondaryAncestors.clear();
+        for (const ClassDefinition* ancestor : ancestors) {
+            def->secondaryAncestors.push_back(ancestor->classID);
+        }
+        std::sort(def->secondaryAncestors.begin(), def->secondaryAncestors.end());
+    }
+}
+
+gdx::JsonValue dumpType(const CxxType* type) {
+    return {
+        "namespace", type->ns,
+        "type" , type->type,
+        "spelling", type->spelling
+    };    
+}
+
+gdx::JsonValue dumpParam(const MethodParameter& param) {
+    gdx::JsonValue tp;
+    if (param.type->index >= 0) {
+        tp["type_index"] = param.type->index;
+    } else {
+        tp = dumpType(param.type);
+    }
+
+    tp += {
+      "name" , param.name,
+      "is_const" , param.isConst,
+      "is_pointer", param.isPointer,
+      "is_ref", param.isReference
+    };
+    
+    return tp;    
+}
+
+int nextTypeIndex = 0;
+
+//indexes every type in typeMapping by spelling, so the table is stable for identical input
+void indexTypes(gdx::JsonValue& types) {
+    std::vector< CxxType* > sorted;
+    for (const auto& type : typeMapping) {
+        sorted.push_back(type.second);
+    }
+
+    std::sort(sorted.begin(), sorted.end(), [](const CxxType* a, const CxxType* b) {
+        return a->spelling < b->spelling;
+    });
+
+    types.as_array();
+    for (CxxType* type : sorted) {
+        type->index = nextTypeIndex++;
+        types.at(type->index) = dumpType(type);
+    }
+}
+
+//streamed records can only index types as they show up, appends the ones def uses for the first time
+void indexTypes(const ClassDefinition& def, gdx::JsonValue& types) {
+    auto add = [&types](CxxType* type) {
+        if (type && type->index < 0) {
+            type->index = nextTypeIndex++;
+            types.as_array().push_back(dumpType(type));
+        }
+    };
+
+    for (const auto& field : def.fields) {
+        add(field.type.type);
+    }
+
+    for (const auto& method : def.methods) {
+        for (const auto& param : method.parameters) {
+            add(param.type);
+        }
+
+        //constructors have no return type, see dump
+        if (method.functionType != MethodDefinition::FuncType::constructor) {
+            add(method.retType.type);
+        }
+    }
+}
+
+uint32_t fnv1a(uint32_t hash, const char* data, size_t size) {
+    for (size_t i = 0; i < size; ++i) {
+        hash ^= static_cast<unsigned char>(data[i]);
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+/**
+ * FNV-1a over the parameter types as they are keyed in typeMapping, each
+ * followed by a pointer/reference/const flag byte and a zero separator.
+ */
+uint32_t signatureHash(const MethodDefinition& method) {
+    uint32_t hash = 2166136261u;
+
+    for (const auto& param : method.parameters) {
+        const std::string& spelling = param.type ? param.type->spelling : std::string();
+        char flags[2] = { static_cast<char>(param.isPointer | param.isReference << 1 | param.isConst << 2), 0 };
+
+        hash = fnv1a(hash, spelling.data(), spelling.size());
+        hash = fnv1a(hash, flags, sizeof(flags));
+    }
+
+    return hash;
+}
+
+std::string hexHash(uint32_t hash) {
+    char buffer[16];
+    snprintf(buffer, sizeof(buffer), "%08x", hash);
+    return buffer;
+}
+
+bool isIntegerSpelling(const std::string& spelling) {
+    static const std::set< std::string > integers {
+        "char", "signed char", "unsigned char", "short", "unsigned short", "int", "unsigned int",
+        "long", "unsigned long", "long long", "unsigned long long"
+    };
+    return integers.count(spelling) != 0;
+}
+
+bool isFloatingSpelling(const std::string& spelling) {
+    return spelling == "float" || spelling == "double" || spelling == "long double";
+}
+
+//std::string only, the char16_t and char32_t flavours don't convert from lua strings
+bool isStringSpelling(const std::string& spelling) {
+    return spelling.compare(0, 23, "std::basic_string<char,") == 0;
+}
+
+//how selective a lua type check for the parameter is, strict checks get tried first
+int parameterSpecificity(const MethodParameter& param) {
+    if (!param.type) {
+        return 0;
+    }
+
+    const std::string& spelling = param.type->spelling;
+
+    if (param.isPointer) {
+        if (spelling == "char") {
+            return 1;
+        }
+        return param.type->type.empty() ? 0 : 5;
+    }
+
+    if (isStringSpelling(spelling)) {
+        //numbers convert to strings, so strings go after every numeric check
+        return 1;
+    }
+    if (!param.type->type.empty()) {
+        return 5;
+    }
+    if (spelling == "bool") {
+        return 4;
+    }
+    if (isIntegerSpelling(spelling)) {
+        return 3;
+    }
+    if (isFloatingSpelling(spelling)) {
+        return 2;
+    }
+
+    return 0;
+}
+
+/**
+ * Groups the methods sharing a name (and the constructors) into overload
+ * sets, each indexed by arity. Within an arity the candidates are listed in
+ * dispatch order: most selective argument checks first, ties broken by
+ * signature hash so the order is stable.
+ */
+typedef std::map< std::string, std::map< size_t, std::vector< size_t > > > OverloadSets;
+
+OverloadSets overloadSets(const ClassDefinition& def, bool constructors) {
+    OverloadSets grouped;
+
+    for (size_t i = 0; i < def.methods.size(); ++i) {
+        const MethodDefinition& method = def.methods[i];
+        if ((method.functionType == MethodDefinition::FuncType::constructor) != constructors) {
+            continue;
+        }
+        //with default arguments a candidate is callable with any count from the required ones up
+        auto& set = grouped[constructors ? def.name : method.name];
+        for (size_t arity = method.requiredParameters; arity <= method.parameters.size(); ++arity) {
+            set[arity].push_back(i);
+        }
+    }
+
+    for (auto& set : grouped) {
+        for (auto& arity : set.second) {
+            size_t count = arity.first;
+
+            //only the arguments actually passed are checked, the defaults don't make a candidate more selective
+            std::stable_sort(arity.second.begin(), arity.second.end(), [&def, count](size_t a, size_t b) {
+                int scoreA = 0, scoreB = 0;
+                for (size_t i = 0; i < count; ++i) {
+                    scoreA += parameterSpecificity(def.methods[a].parameters[i]);
+                    scoreB += parameterSpecificity(def.methods[b].parameters[i]);
+                }
+
+                if (scoreA != scoreB) {
+                    return scoreA > scoreB;
+                }
+
+                //an exact match beats one that relies on defaults
+                size_t sizeA = def.methods[a].parameters.size(), sizeB = def.methods[b].parameters.size();
+                if (sizeA != sizeB) {
+                    return sizeA < sizeB;
+                }
+                return signatureHash(def.methods[a]) < signatureHash(def.methods[b]);
+            });
+        }
+    }
+
+    return grouped;
+}
+
+void dumpOverloads(gdx::JsonValue& sets, const ClassDefinition& def, bool constructors) {
+    sets.as_item_map();
+
+    for (auto& set : overloadSets(def, constructors)) {
+        gdx::JsonValue& jset = sets[set.first];
+        jset["arities"].as_item_map();
+
+        for (auto& arity : set.second) {
+            std::vector< size_t >& candidates = arity.second;
+
+            std::ostringstream key;
+            key << arity.first;
+
+            gdx::JsonValue& order = jset["arities"][key.str()];
+            order.as_array();
+            for (size_t j = 0; j < candidates.size(); ++j) {
+                order.at(j) = static_cast<int>(candidates[j]);
+            }
+        }
+
+        jset["min_arity"] = static_cast<int>(set.second.begin()->first);
+        jset["max_arity"] = static_cast<int>(set.second.rbegin()->first);
+    }
+}
+
+//member lookup hash, FNV-1a over the little endian seed bytes followed by the name
+uint32_t memberHash(const std::string& name, uint32_t seed) {
+    char bytes[4] = {
+        static_cast<char>(seed), static_cast<char>(seed >> 8), static_cast<char>(seed >> 16), static_cast<char>(seed >> 24)
+    };
+
+    uint32_t hash = fnv1a(2166136261u, bytes, sizeof(bytes));
+    return fnv1a(hash, name.data(), name.size());
+}
+
+struct FlatMember {
+    std::string name;
+    const ClassDefinition* owner;
+    const char* kind;
+};
+
+//every member name reachable from def, a name declared closer to def hides the inherited ones
+void flattenMembers(const ClassDefinition& def, std::vector< FlatMember >& members) {
+    std::set< std::string > seen;
+    std::set< const ClassDefinition* > visited;
+    std::deque< const ClassDefinition* > pending(1, &def);
+
+    while (!pending.empty()) {
+        const ClassDefinition* current = pending.front();
+        pending.pop_front();
+
+        if (!visited.insert(current).second) {
+            continue;
+        }
+
+        std::set< std::string > declared;
+
+        for (const auto& method : current->methods) {
+            if (method.functionType == MethodDefinition::FuncType::method && !seen.count(method.name)
+                    && declared.insert(method.name).second) {
+                members.push_back({ method.name, current, "function" });
+            }
+        }
+
+        for (const auto& field : current->fields) {
+            if (!seen.count(field.type.name) && declared.insert(field.type.name).second) {
+                members.push_back({ field.type.name, current, "field" });
+            }
+        }
+
+        seen.insert(declared.begin(), declared.end());
+        pending.insert(pending.end(), current->bases.begin(), current->bases.end());
+    }
+}
+
+/**
+ * Minimal perfect hash over the flattened member names, built by hash and
+ * displace: names go to bucket memberHash(name, 0) % buckets, and each
+ * bucket gets the smallest displacement d sending all its names to free
+ * slots memberHash(name, d) % slots. Lookups must still compare the name in
+ * the slot, unknown names land on an arbitrary one.
+ */
+//one hash and displace attempt with bucketCount buckets, false when some bucket finds no displacement
+bool buildMemberHash(const std::vector< FlatMember >& members, uint32_t bucketCount,
+                     std::vector< int >& displacements, std::vector< int >& slots) {
+    const uint32_t slotCount = members.size();
+
+    std::vector< std::vector< uint32_t > > buckets(bucketCount);
+    for (uint32_t i = 0; i < slotCount; ++i) {
+        buckets[memberHash(members[i].name, 0) % bucketCount].push_back(i);
+    }
+
+    std::vector< uint32_t > order(bucketCount);
+    for (uint32_t i = 0; i < bucketCount; ++i) {
+        order[i] = i;
+    }
+    std::stable_sort(order.begin(), order.end(), [&buckets](uint32_t a, uint32_t b) {
+        return buckets[a].size() > buckets[b].size();
+    });
+
+    displacements.assign(bucketCount, 0);
+    slots.assign(slotCount, -1);
+    std::vector< uint32_t > placed;
+
+    for (uint32_t bucket : order) {
+        if (buckets[bucket].empty()) {
+            break;
+        }
+
+        bool found = false;
+        for (uint32_t seed = 1; seed < (1u << 20) && !found; ++seed) {
+            placed.clear();
+            found = true;
+
+            for (uint32_t member : buckets[bucket]) {
+                uint32_t slot = memberHash(members[member].name, seed) % slotCount;
+                if (slots[slot] >= 0 || std::find(placed.begin(), placed.end(), slot) != placed.end()) {
+                    found = false;
+                    break;
+                }
+                placed.push_back(slot);
+            }
+
+            if (found) {
+                displacements[bucket] = seed;
+                for (size_t i = 0; i < placed.size(); ++i) {
+                    slots[placed[i]] = buckets[bucket][i];
+                }
+            }
+        }
+
+        if (!found) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+void dumpMemberHash(gdx::JsonValue& table, const ClassDefinition& def) {
+    std::vector< FlatMember > members;
+    flattenMembers(def, members);
+
+    table["function"] = std::string("fnv1a32");
+    table["displacements"].as_array();
+    table["slots"].as_array();
+
+    //no members, no lookups: both arrays stay empty
+    if (members.empty()) {
+        return;
+    }
+
+    const uint32_t slotCount = members.size();
+    std::vector< int > displacements, slots;
+
+    //smaller buckets are easier to place, keep adding buckets until every one fits
+    uint32_t bucketCount = std::max< uint32_t >(1, (slotCount + 1) / 2);
+    while (!buildMemberHash(members, bucketCount, displacements, slots)) {
+        if (bucketCount >= 4 * slotCount) {
+            std::cerr << "clang-lua-generator: no member hash found for " << def.qualifiedName << std::endl;
+            table["displacements"].as_array().clear();
+            return;
+        }
+        bucketCount *= 2;
+    }
+
+    for (uint32_t i = 0; i < displacements.size(); ++i) {
+        table["displacements"].at(i) = displacements[i];
+    }
+
+    for (uint32_t i = 0; i < slotCount; ++i) {
+        const FlatMember& member = members[slots[i]];
+        table["slots"].at(i) = gdx::JsonValue {
+            "name", member.name,
+            "owner", member.owner->qualifiedName,
+            "kind", member.kind
+        };
+    }
+}
+
+std::string dump(gdx::JsonValue& classDef, const ClassDefinition& def) {
+    std::stringstream ss;
     
     unsigned int i = 0;
     gdx::JsonValue& jdef = classDef[def.qualifiedName];
@@ -358,12 +1565,94 @@ std::string dump(gdx::JsonValue& classDef, const ClassDefinition& def) {
     }
     
     jdef["templated"] = def.isTemplated;
+    jdef["final"] = def.isFinal;
+    jdef["abstract"] = def.isAbstract;
+    jdef["external_linkage"] = def.hasExternalLinkage;
+    jdef["accessible"] = def.isAccessible;
+    jdef["main_file"] = def.isInMainFile;
 
     i = 0;
     jdef["bases"].as_array();
     for (const auto& dependency : def.bases) {
         jdef["bases"].at(i++).as_string() = dependency->name;
     }        
+
+    jdef["id"] = static_cast<int>(def.classID);
+
+    jdef["traits"] = gdx::JsonValue {
+        "trivially_copyable", def.isTriviallyCopyable,
+        "trivially_destructible", def.isTriviallyDestructible,
+        "standard_layout", def.isStandardLayout,
+        "nothrow_move_constructible", def.isNothrowMoveConstructible,
+        "default_constructible", def.hasDefaultConstructor,
+        "destructible", def.isDestructible,
+        "copy_constructible", def.isCopyConstructible,
+        "move_constructible", def.isMoveConstructible
+    };
+
+    if (def.hasLayout) {
+        gdx::JsonValue& layout = jdef["layout"];
+        layout["size"] = static_cast<int>(def.size);
+        layout["align"] = static_cast<int>(def.alignment);
+
+        i = 0;
+        layout["fields"].as_array();
+        for (const auto& field : def.fields) {
+            gdx::JsonValue jfield = dumpParam(field.type);
+            jfield["offset"] = static_cast<int>(field.offset);
+
+            if (field.isBitField) {
+                jfield["bit_offset"] = static_cast<int>(field.bitOffset);
+                jfield["bit_width"] = static_cast<int>(field.bitWidth);
+            }
+
+            layout["fields"].at(i++) = jfield;
+        }
+    }
+
+    if (def.rangeEnd) {
+        jdef["type_range"].at(0) = static_cast<int>(def.rangeBegin);
+        jdef["type_range"].at(1) = static_cast<int>(def.rangeEnd);
+
+        i = 0;
+        jdef["secondary_ancestors"].as_array();
+        for (unsigned int ancestor : def.secondaryAncestors) {
+            jdef["secondary_ancestors"].at(i++) = static_cast<int>(ancestor);
+        }
+    } else {
+        //streamed records can't know the final tree, list every ancestor instead
+        std::set< const ClassDefinition* > ancestors;
+        collectAncestors(&def, ancestors);
+
+        std::vector< int > ids;
+        for (const ClassDefinition* ancestor : ancestors) {
+            ids.push_back(ancestor->classID);
+        }
+        std::sort(ids.begin(), ids.end());
+
+        i = 0;
+        jdef["ancestors"].as_array();
+        for (int id : ids) {
+            jdef["ancestors"].at(i++) = id;
+        }
+    }
+
+    i = 0;
+    jdef["upcasts"].as_array();
+    for (const auto& upcast : def.upcasts) {
+        gdx::JsonValue entry {
+            "base", upcast.qualifiedName,
+            "offset", static_cast<int>(upcast.offset),
+            "virtual", upcast.isVirtual
+        };
+
+        auto base = classMapping.find(upcast.qualifiedName);
+        if (base != classMapping.end()) {
+            entry["id"] = static_cast<int>(base->second->classID);
+        }
+
+        jdef["upcasts"].at(i++) = entry;
+    }
     
     i = 0;
     jdef["functions"].as_array();
@@ -371,8 +1660,22 @@ std::string dump(gdx::JsonValue& classDef, const ClassDefinition& def) {
         gdx::JsonValue function {
             "func_type", (method.functionType == MethodDefinition::FuncType::constructor ? "constructor" : "function"),
             "name", method.name,
-            "is_virtual", method.isVirtual
+            "is_virtual", method.isVirtual,
+            "is_final", method.isFinal,
+            "is_override", !method.overrides.empty(),
+            "is_pure", method.isPure,
+            "is_noexcept", method.isNoexcept,
+            "is_deleted", method.isDeleted,
+            "required_params", static_cast<int>(method.requiredParameters),
+            "signature", hexHash(signatureHash(method))
         };
+
+        //overrides may live in records we never see, only the declaration itself can promise a direct call
+        function["can_devirtualize"] = !method.isPure && (!method.isVirtual || method.isFinal || def.isFinal);
+
+        if (overridesResolved) {
+            function["is_overridden"] = method.isOverridden;
+        }
         
         int j = 0;
         function["params"].as_array();
@@ -383,33 +1686,2441 @@ std::string dump(gdx::JsonValue& classDef, const ClassDefinition& def) {
         if (method.functionType != MethodDefinition::FuncType::constructor) {
             function["return"] = dumpParam(method.retType);            
         }
+
+        if (method.accessor != MethodDefinition::AccessorKind::none) {
+            gdx::JsonValue& accessor = function["accessor"];
+
+            if (method.accessor == MethodDefinition::AccessorKind::constant) {
+                accessor["kind"] = std::string("constant");
+                accessor["value"] = method.accessorValue;
+            } else {
+                accessor["kind"] = std::string(method.accessor == MethodDefinition::AccessorKind::getter ? "getter" : "setter");
+                accessor["field"] = method.accessorField;
+                if (method.accessorOffset >= 0) {
+                    accessor["offset"] = static_cast<int>(method.accessorOffset);
+                }
+            }
+        }
         
         jdef["functions"].at(i++) = function;
     }
 
+    dumpMemberHash(jdef["member_hash"], def);
+    dumpOverloads(jdef["overloads"], def, false);
+    dumpOverloads(jdef["constructor_overloads"], def, true);
+
     return ss.str();
 }
 
+/**
+ * Builds and serializes each class record on its own, spread over a few
+ * threads, and splices the text back into classes as raw values. Records
+ * are serialized at the depth they have in the document, so the output is
+ * byte for byte what serializing the whole tree would give.
+ */
+void serializeClasses(gdx::JsonValue& classes, bool prettyPrint, unsigned int threads) {
+    std::vector< ClassDefinition* > defs = sortedClasses();
+    std::vector< std::string > records(defs.size());
+    std::atomic< size_t > next(0);
 
-int main ( int argc, const char** argv ) {
-    CommonOptionsParser parser( argc, argv );
+    auto work = [&]() {
+        for (size_t i = next++; i < defs.size(); i = next++) {
+            gdx::JsonValue holder;
+            dump(holder, *defs[i]);
+            holder[defs[i]->qualifiedName].toString(records[i], prettyPrint, 2);
+        }
+    };
 
-    std::ofstream of;
-    of.open(OutputPath, std::ofstream::out);
-    
-    ClangTool tool(parser.GetCompilations(), parser.GetSourcePathList());
+    if (threads == 0) {
+        threads = std::max(1u, std::thread::hardware_concurrency());
+    }
+    threads = std::min< size_t >(threads, defs.size());
 
-    int result = tool.run ( newFrontendActionFactory<BuildLuaBindingsAction>() );
-       
-    gdx::JsonValue json;
-        
-    for (const auto& cls: classMapping) {
-        dump(json["classes"], *cls.second);
+    std::vector< std::thread > pool;
+    for (unsigned int i = 1; i < threads; ++i) {
+        pool.emplace_back(work);
+    }
+    work();
+
+    for (auto& thread : pool) {
+        thread.join();
+    }
+
+    for (size_t i = 0; i < defs.size(); ++i) {
+        classes[defs[i]->qualifiedName] = gdx::JsonValue::raw(std::move(records[i]));
+    }
+}
+
+/**
+ * Writes newline delimited records on a background thread, so the file io
+ * overlaps with parsing the next translation unit.
+ */
+class NdjsonWriter {
+public:
+    NdjsonWriter(const std::string& path) : out(path.c_str(), std::ofstream::out), done(false) {
+        worker = std::thread(&NdjsonWriter::run, this);
+    }
+
+    ~NdjsonWriter() {
+        finish();
+    }
+
+    void push(std::string&& record) {
+        {
+            std::lock_guard< std::mutex > lock(mutex);
+            pending.push_back(std::move(record));
+        }
+        ready.notify_one();
+    }
+
+    void finish() {
+        {
+            std::lock_guard< std::mutex > lock(mutex);
+            if (done) {
+                return;
+            }
+            done = true;
+        }
+        ready.notify_one();
+        worker.join();
+        out.close();
+    }
+
+private:
+    void run() {
+        std::unique_lock< std::mutex > lock(mutex);
+
+        for (;;) {
+            ready.wait(lock, [this] { return done || !pending.empty(); });
+
+            if (pending.empty()) {
+                return;
+            }
+
+            std::deque< std::string > batch;
+            batch.swap(pending);
+            lock.unlock();
+
+            for (const std::string& record : batch) {
+                out.write(record.data(), record.size());
+                out.put('\n');
+            }
+            out.flush();
+
+            lock.lock();
+        }
+    }
+
+    std::ofstream out;
+    std::thread worker;
+    std::mutex mutex;
+    std::condition_variable ready;
+    std::deque< std::string > pending;
+    bool done;
+};
+
+NdjsonWriter* streamWriter = nullptr;
+std::vector< ClassDefinition* >* workerResults = nullptr;
+
+void translationUnitDone(const std::string& file, const std::vector< ClassDefinition* >& classes) {
+    if (workerResults) {
+        workerResults->insert(workerResults->end(), classes.begin(), classes.end());
+        return;
+    }
+
+    if (!streamWriter) {
+        return;
+    }
+
+    gdx::JsonValue record;
+    record["tu"] = file;
+    record["classes"].as_item_map();
+
+    for (ClassDefinition* cls : classes) {
+        classId(cls);
+
+        std::set< const ClassDefinition* > ancestors;
+        collectAncestors(cls, ancestors);
+        for (const ClassDefinition* ancestor : ancestors) {
+            classId(const_cast< ClassDefinition* >(ancestor));
+        }
+    }
+
+    if (TypeTable) {
+        int first = nextTypeIndex;
+        gdx::JsonValue types;
+        for (const ClassDefinition* cls : classes) {
+            indexTypes(*cls, types);
+        }
+
+        if (nextTypeIndex != first) {
+            record["first_type"] = first;
+            record["types"] = types;
+        }
+    }
+
+    for (const ClassDefinition* cls : classes) {
+        dump(record["classes"], *cls);
+    }
+
+    std::string line;
+    record.toString(line, false);
+    streamWriter->push(std::move(line));
+}
+
+
+/**
+ * Flat binary encoding of the extracted model, used to ship classes from the
+ * worker processes back to the parent. Strings are length prefixed and every
+ * integer is a native uint32, both ends are the same binary.
+ */
+class RecordWriter {
+public:
+    RecordWriter(std::string& buffer) : out(buffer) {
+    }
+
+    void u32(uint32_t value) {
+        out.append(reinterpret_cast<const char*>(&value), sizeof(value));
+    }
+
+    void flag(bool value) {
+        out.push_back(value ? 1 : 0);
+    }
+
+    void str(const std::string& value) {
+        u32(value.size());
+        out.append(value);
+    }
+
+private:
+    std::string& out;
+};
+
+class RecordReader {
+public:
+    RecordReader(const char* data, size_t size) : cur(data), end(data + size) {
+    }
+
+    uint32_t u32() {
+        uint32_t value = 0;
+        if (available(sizeof(value))) {
+            memcpy(&value, cur, sizeof(value));
+            cur += sizeof(value);
+        }
+        return value;
+    }
+
+    bool flag() {
+        if (!available(1)) {
+            return false;
+        }
+        return *cur++ != 0;
+    }
+
+    std::string str() {
+        uint32_t size = u32();
+        if (!available(size)) {
+            return std::string();
+        }
+        std::string value(cur, size);
+        cur += size;
+        return value;
+    }
+
+    bool good() const {
+        return cur != nullptr;
+    }
+
+private:
+    bool available(size_t size) {
+        if (!cur || static_cast<size_t>(end - cur) < size) {
+            cur = end = nullptr;
+            return false;
+        }
+        return true;
+    }
+
+    const char* cur;
+    const char* end;
+};
+
+void writeParameter(RecordWriter& w, const MethodParameter& param) {
+    w.flag(param.type != nullptr);
+    if (param.type) {
+        w.str(param.type->spelling);
+        w.str(param.type->ns);
+        w.str(param.type->type);
+        w.flag(param.type->isPrimitive);
+        w.flag(param.type->isTypedef);
+    }
+
+    w.flag(param.isPointer);
+    w.flag(param.isReference);
+    w.flag(param.isConst);
+    w.flag(param.isPointeeConst);
+    w.str(param.name);
+}
+
+MethodParameter readParameter(RecordReader& r) {
+    MethodParameter param;
+
+    if (r.flag()) {
+        std::string spelling = r.str();
+        CxxType*& type = typeMapping[spelling];
+
+        if (!type) {
+            type = new CxxType;
+            type->spelling = spelling;
+            type->ns = r.str();
+            type->type = r.str();
+            type->isPrimitive = r.flag();
+            type->isTypedef = r.flag();
+        } else {
+            r.str();
+            r.str();
+            r.flag();
+            r.flag();
+        }
+
+        param.type = type;
+    }
+
+    param.isPointer = r.flag();
+    param.isReference = r.flag();
+    param.isConst = r.flag();
+    param.isPointeeConst = r.flag();
+    param.name = r.str();
+
+    return param;
+}
+
+void writeClass(RecordWriter& w, const ClassDefinition& def) {
+    w.str(def.qualifiedName);
+    w.str(def.name);
+    w.str(def.file);
+    w.flag(def.isTemplated);
+    w.flag(def.isFinal);
+    w.flag(def.isAbstract);
+    w.flag(def.hasExternalLinkage);
+    w.flag(def.isAccessible);
+    w.flag(def.isInMainFile);
+
+    w.u32(def.dependencies.size());
+    for (const auto& dependency : def.dependencies) {
+        w.str(dependency);
+    }
+
+    w.u32(def.bases.size());
+    for (const auto& base : def.bases) {
+        w.str(base->qualifiedName);
+    }
+
+    w.flag(def.isTriviallyCopyable);
+    w.flag(def.isTriviallyDestructible);
+    w.flag(def.isStandardLayout);
+    w.flag(def.isNothrowMoveConstructible);
+    w.flag(def.hasDefaultConstructor);
+    w.flag(def.isDestructible);
+    w.flag(def.isCopyConstructible);
+    w.flag(def.isMoveConstructible);
+
+    w.flag(def.hasLayout);
+    w.u32(def.size);
+    w.u32(def.alignment);
+
+    w.u32(def.fields.size());
+    for (const auto& field : def.fields) {
+        writeParameter(w, field.type);
+        w.u32(field.offset);
+        w.flag(field.isBitField);
+        w.u32(field.bitOffset);
+        w.u32(field.bitWidth);
+    }
+
+    w.u32(def.upcasts.size());
+    for (const auto& upcast : def.upcasts) {
+        w.str(upcast.qualifiedName);
+        w.u32(static_cast<uint32_t>(upcast.offset));
+        w.flag(upcast.isVirtual);
+    }
+
+    w.u32(def.methods.size());
+    for (const auto& method : def.methods) {
+        w.str(method.name);
+        w.u32(static_cast<uint32_t>(method.functionType));
+        w.flag(method.isVirtual);
+        w.flag(method.isFinal);
+        w.flag(method.isPure);
+        w.flag(method.isNoexcept);
+        w.flag(method.isDeleted);
+        w.u32(method.requiredParameters);
+        w.str(method.key);
+
+        w.u32(method.overrides.size());
+        for (const auto& overridden : method.overrides) {
+            w.str(overridden);
+        }
+
+        w.u32(static_cast<uint32_t>(method.accessor));
+        w.str(method.accessorField);
+        w.u32(static_cast<uint32_t>(method.accessorOffset));
+        w.str(method.accessorValue);
+        writeParameter(w, method.retType);
+
+        w.u32(method.parameters.size());
+        for (const auto& param : method.parameters) {
+            writeParameter(w, param);
+        }
+    }
+}
+
+/**
+ * Reads a class written by writeClass and merges it into classMapping,
+ * returning it, or nullptr when another translation unit already provided
+ * the definition.
+ */
+ClassDefinition* readClass(RecordReader& r) {
+    std::string qualname = r.str();
+    std::string name = r.str();
+
+    ClassDefinition*& existing = classMapping[qualname];
+    if (!existing) {
+        existing = new ClassDefinition(name, qualname);
+    }
+
+    //the record still has to be consumed when we already have it
+    ClassDefinition scratch(name, qualname);
+    ClassDefinition* clazz = existing->processed ? &scratch : existing;
+
+    clazz->name = name;
+    clazz->file = r.str();
+    clazz->isTemplated = r.flag();
+    clazz->isFinal = r.flag();
+    clazz->isAbstract = r.flag();
+    clazz->hasExternalLinkage = r.flag();
+    clazz->isAccessible = r.flag();
+    clazz->isInMainFile = r.flag();
+
+    for (uint32_t i = 0, count = r.u32(); i < count && r.good(); ++i) {
+        clazz->dependencies.insert(r.str());
+    }
+
+    for (uint32_t i = 0, count = r.u32(); i < count && r.good(); ++i) {
+        std::string base = r.str();
+        ClassDefinition*& baseDef = classMapping[base];
+        if (!baseDef) {
+            baseDef = new ClassDefinition(base, base);
+        }
+        clazz->bases.push_back(baseDef);
+    }
+
+    clazz->isTriviallyCopyable = r.flag();
+    clazz->isTriviallyDestructible = r.flag();
+    clazz->isStandardLayout = r.flag();
+    clazz->isNothrowMoveConstructible = r.flag();
+    clazz->hasDefaultConstructor = r.flag();
+    clazz->isDestructible = r.flag();
+    clazz->isCopyConstructible = r.flag();
+    clazz->isMoveConstructible = r.flag();
+
+    clazz->hasLayout = r.flag();
+    clazz->size = r.u32();
+    clazz->alignment = r.u32();
+
+    for (uint32_t i = 0, count = r.u32(); i < count && r.good(); ++i) {
+        FieldDefinition field;
+        field.type = readParameter(r);
+        field.offset = r.u32();
+        field.isBitField = r.flag();
+        field.bitOffset = r.u32();
+        field.bitWidth = r.u32();
+        clazz->fields.push_back(field);
+    }
+
+    for (uint32_t i = 0, count = r.u32(); i < count && r.good(); ++i) {
+        BaseOffset upcast;
+        upcast.qualifiedName = r.str();
+        upcast.offset = static_cast<int32_t>(r.u32());
+        upcast.isVirtual = r.flag();
+        clazz->upcasts.push_back(upcast);
+    }
+
+    for (uint32_t i = 0, count = r.u32(); i < count && r.good(); ++i) {
+        MethodDefinition md;
+        md.name = r.str();
+        md.functionType = static_cast<MethodDefinition::FuncType>(r.u32());
+        md.isVirtual = r.flag();
+        md.isFinal = r.flag();
+        md.isPure = r.flag();
+        md.isNoexcept = r.flag();
+        md.isDeleted = r.flag();
+        md.requiredParameters = r.u32();
+        md.key = r.str();
+
+        for (uint32_t j = 0, overrides = r.u32(); j < overrides && r.good(); ++j) {
+            md.overrides.push_back(r.str());
+        }
+
+        md.accessor = static_cast<MethodDefinition::AccessorKind>(r.u32());
+        md.accessorField = r.str();
+        md.accessorOffset = static_cast<int32_t>(r.u32());
+        md.accessorValue = r.str();
+        md.retType = readParameter(r);
+
+        for (uint32_t j = 0, params = r.u32(); j < params && r.good(); ++j) {
+            md.parameters.push_back(readParameter(r));
+        }
+
+        clazz->methods.push_back(md);
+    }
+
+    if (clazz == &scratch) {
+        return nullptr;
+    }
+
+    clazz->processed = true;
+    return clazz;
+}
+
+bool readFully(int fd, void* data, size_t size) {
+    char* p = static_cast<char*>(data);
+    while (size > 0) {
+        ssize_t got = read(fd, p, size);
+        if (got < 0 && errno == EINTR) {
+            continue;
+        }
+        if (got <= 0) {
+            return false;
+        }
+        p += got;
+        size -= got;
+    }
+    return true;
+}
+
+bool writeFully(int fd, const void* data, size_t size) {
+    const char* p = static_cast<const char*>(data);
+    while (size > 0) {
+        ssize_t written = write(fd, p, size);
+        if (written < 0 && errno == EINTR) {
+            continue;
+        }
+        if (written <= 0) {
+            return false;
+        }
+        p += written;
+        size -= written;
+    }
+    return true;
+}
+
+/**
+ * Runs translation units in forked worker processes, so a crashing or
+ * hanging unit only takes its worker down. Units are handed out longest
+ * first using the timings recorded by the previous run. Workers are forked
+ * by a fork server started before any thread, since a child of a threaded
+ * process may only make async-signal-safe calls, let alone run clang.
+ */
+class WorkerPool {
+public:
+    WorkerPool(const CompilationDatabase& _compilations, const std::vector< std::string >& _sources)
+        : compilations(_compilations), sources(_sources), timings(_sources.size(), -1.0), attempts(_sources.size(), 0) {
+    }
+
+    //must be called while the process is still single threaded
+    void start() {
+        signal(SIGPIPE, SIG_IGN);
+
+        int fds[2];
+        if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) != 0) {
+            perror("socketpair");
+            exit(1);
+        }
+
+        pid_t pid = fork();
+        if (pid < 0) {
+            perror("fork");
+            exit(1);
+        }
+
+        if (pid == 0) {
+            close(fds[0]);
+            _exit(forkServer(fds[1]));
+        }
+
+        close(fds[1]);
+        server = fds[0];
+        serverPid = pid;
+    }
+
+    int run(unsigned int jobs) {
+        loadTimings();
+
+        std::vector< uint32_t > order(sources.size());
+        for (uint32_t i = 0; i < order.size(); ++i) {
+            order[i] = i;
+        }
+
+        //units we never timed go first, they are as likely as any to be the slow ones
+        std::stable_sort(order.begin(), order.end(), [this](uint32_t a, uint32_t b) {
+            double ta = timings[a] < 0 ? 1e30 : timings[a];
+            double tb = timings[b] < 0 ? 1e30 : timings[b];
+            return ta > tb;
+        });
+
+        queue.assign(order.begin(), order.end());
+        workers.resize(std::min<size_t>(jobs, sources.size()));
+
+        for (Worker& worker : workers) {
+            spawn(worker);
+        }
+
+        int result = 0;
+        std::vector< pollfd > fds;
+
+        while (!queue.empty() || busyWorkers() > 0) {
+            for (Worker& worker : workers) {
+                if (worker.pid > 0 && worker.tu < 0 && !queue.empty()) {
+                    dispatch(worker);
+                }
+            }
+
+            fds.clear();
+            for (const Worker& worker : workers) {
+                fds.push_back({ worker.resultFd, POLLIN, 0 });
+            }
+
+            int ready = poll(fds.data(), fds.size(), 1000);
+            if (ready < 0 && errno != EINTR) {
+                perror("poll");
+                break;
+            }
+
+            for (size_t i = 0; i < workers.size(); ++i) {
+                Worker& worker = workers[i];
+
+                if (fds[i].revents & (POLLIN | POLLHUP | POLLERR)) {
+                    if (!receive(worker, result)) {
+                        lost(worker, "crashed");
+                    }
+                } else if (worker.tu >= 0 && TranslationUnitTimeout > 0
+                           && secondsSince(worker.started) > TranslationUnitTimeout) {
+                    kill(worker.pid, SIGKILL);
+                    lost(worker, "timed out");
+                }
+            }
+        }
+
+        for (Worker& worker : workers) {
+            shutdown(worker);
+        }
+
+        //the server exits once every worker it forked is gone
+        close(server);
+        waitpid(serverPid, nullptr, 0);
+
+        for (uint32_t i = 0; i < sources.size(); ++i) {
+            if (failed.count(i)) {
+                std::cerr << "clang-lua-generator: gave up on " << sources[i] << std::endl;
+                result = 1;
+            }
+        }
+
+        saveTimings();
+        return result;
+    }
+
+private:
+    struct Worker {
+        pid_t pid = -1;
+        int commandFd = -1;
+        int resultFd = -1;
+        int tu = -1;
+        std::chrono::steady_clock::time_point started;
+        std::string inbox;
+    };
+
+    static double secondsSince(std::chrono::steady_clock::time_point start) {
+        return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    }
+
+    size_t busyWorkers() const {
+        size_t busy = 0;
+        for (const Worker& worker : workers) {
+            busy += worker.tu >= 0;
+        }
+        return busy;
+    }
+
+    //the server answers each request byte with the worker pid and its two pipe ends
+    static bool sendWorker(int socket, pid_t pid, const int fds[2]) {
+        int32_t id = pid;
+        iovec iov = { &id, sizeof(id) };
+
+        char control[CMSG_SPACE(2 * sizeof(int))];
+        memset(control, 0, sizeof(control));
+
+        msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+
+        cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(2 * sizeof(int));
+        memcpy(CMSG_DATA(cmsg), fds, 2 * sizeof(int));
+
+        return sendmsg(socket, &msg, 0) == sizeof(id);
+    }
+
+    static bool receiveWorker(int socket, pid_t& pid, int fds[2]) {
+        int32_t id;
+        iovec iov = { &id, sizeof(id) };
+
+        char control[CMSG_SPACE(2 * sizeof(int))];
+
+        msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+
+        ssize_t got;
+        do {
+            got = recvmsg(socket, &msg, 0);
+        } while (got < 0 && errno == EINTR);
+
+        cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+        if (got != sizeof(id) || !cmsg || cmsg->cmsg_type != SCM_RIGHTS || cmsg->cmsg_len != CMSG_LEN(2 * sizeof(int))) {
+            return false;
+        }
+
+        memcpy(fds, CMSG_DATA(cmsg), 2 * sizeof(int));
+        pid = id;
+        return true;
+    }
+
+    int forkServer(int socket) {
+        char request;
+
+        while (readFully(socket, &request, sizeof(request))) {
+            int command[2], results[2];
+            if (pipe(command) != 0 || pipe(results) != 0) {
+                perror("pipe");
+                return 1;
+            }
+
+            pid_t pid = fork();
+            if (pid < 0) {
+                perror("fork");
+                return 1;
+            }
+
+            if (pid == 0) {
+                close(socket);
+                close(command[1]);
+                close(results[0]);
+                _exit(serve(command[0], results[1]));
+            }
+
+            close(command[0]);
+            close(results[1]);
+
+            //only the parent keeps these, so workers see eof when it closes them
+            int passed[2] = { command[1], results[0] };
+            bool sent = sendWorker(socket, pid, passed);
+            close(command[1]);
+            close(results[0]);
+
+            if (!sent) {
+                break;
+            }
+
+            while (waitpid(-1, nullptr, WNOHANG) > 0) {
+            }
+        }
+
+        while (wait(nullptr) > 0) {
+        }
+        return 0;
+    }
+
+    void spawn(Worker& worker) {
+        char request = 1;
+        pid_t pid;
+        int fds[2];
+
+        if (!writeFully(server, &request, sizeof(request)) || !receiveWorker(server, pid, fds)) {
+            std::cerr << "clang-lua-generator: lost the fork server" << std::endl;
+            exit(1);
+        }
+
+        worker.pid = pid;
+        worker.commandFd = fds[0];
+        worker.resultFd = fds[1];
+        worker.tu = -1;
+        worker.inbox.clear();
+    }
+
+    //workers are children of the fork server, which reaps them
+    void shutdown(Worker& worker) {
+        if (worker.pid <= 0) {
+            return;
+        }
+
+        close(worker.commandFd);
+        close(worker.resultFd);
+        worker.pid = -1;
+    }
+
+    void dispatch(Worker& worker) {
+        uint32_t tu = queue.front();
+        queue.pop_front();
+
+        worker.tu = tu;
+        worker.started = std::chrono::steady_clock::now();
+        attempts[tu]++;
+
+        if (!writeFully(worker.commandFd, &tu, sizeof(tu))) {
+            lost(worker, "crashed");
+        }
+    }
+
+    //the worker died with a unit in flight, requeue it or give up on it
+    void lost(Worker& worker, const char* what) {
+        int tu = worker.tu;
+
+        shutdown(worker);
+        spawn(worker);
+
+        if (tu < 0) {
+            return;
+        }
+
+        if (attempts[tu] <= MaxRetries) {
+            std::cerr << "clang-lua-generator: " << sources[tu] << " " << what << ", retrying" << std::endl;
+            queue.push_back(tu);
+        } else {
+            std::cerr << "clang-lua-generator: " << sources[tu] << " " << what << std::endl;
+            failed.insert(tu);
+        }
+    }
+
+    //reads whatever the worker sent and merges complete frames, false once it is gone
+    bool receive(Worker& worker, int& result) {
+        char chunk[1 << 16];
+        ssize_t got = read(worker.resultFd, chunk, sizeof(chunk));
+
+        if (got < 0 && errno == EINTR) {
+            return true;
+        }
+        if (got <= 0) {
+            return false;
+        }
+
+        worker.inbox.append(chunk, got);
+
+        const size_t header = 3 * sizeof(uint32_t);
+        while (worker.inbox.size() >= header) {
+            RecordReader r(worker.inbox.data(), header);
+            uint32_t tu = r.u32();
+            uint32_t status = r.u32();
+            uint32_t size = r.u32();
+
+            if (worker.inbox.size() < header + size) {
+                break;
+            }
+
+            RecordReader payload(worker.inbox.data() + header, size);
+            std::vector< ClassDefinition* > merged;
+
+            for (uint32_t i = 0, count = payload.u32(); i < count && payload.good(); ++i) {
+                if (ClassDefinition* clazz = readClass(payload)) {
+                    merged.push_back(clazz);
+                }
+            }
+
+            for (uint32_t i = 0, count = payload.u32(); i < count && payload.good(); ++i) {
+                inputFiles.insert(payload.str());
+            }
+
+            worker.inbox.erase(0, header + size);
+
+            timings[tu] = secondsSince(worker.started);
+            worker.tu = -1;
+
+            if (status != 0) {
+                result = 1;
+            }
+
+            translationUnitDone(sources[tu], merged);
+        }
+
+        return true;
+    }
+
+    int serve(int commandFd, int resultFd) {
+        uint32_t tu;
+
+        while (readFully(commandFd, &tu, sizeof(tu))) {
+            std::vector< ClassDefinition* > extracted;
+            workerResults = &extracted;
+            inputFiles.clear();
+
+            ClangTool tool(compilations, std::vector< std::string >(1, sources[tu]));
+            uint32_t status = tool.run(newFrontendActionFactory<BuildLuaBindingsAction>());
+
+            workerResults = nullptr;
+
+            std::string payload;
+            RecordWriter w(payload);
+            w.u32(extracted.size());
+            for (const ClassDefinition* clazz : extracted) {
+                writeClass(w, *clazz);
+            }
+
+            w.u32(inputFiles.size());
+            for (const std::string& file : inputFiles) {
+                w.str(file);
+            }
+
+            std::string frame;
+            RecordWriter header(frame);
+            header.u32(tu);
+            header.u32(status);
+            header.u32(payload.size());
+            frame += payload;
+
+            if (!writeFully(resultFd, frame.data(), frame.size())) {
+                return 1;
+            }
+        }
+
+        if (UseFileCache) {
+            fileCache.report(std::cerr);
+        }
+
+        return 0;
+    }
+
+    void loadTimings() {
+        if (TimingsPath.empty()) {
+            return;
+        }
+
+        std::unordered_map< std::string, size_t > index;
+        for (size_t i = 0; i < sources.size(); ++i) {
+            index[sources[i]] = i;
+        }
+
+        std::ifstream in(TimingsPath.c_str());
+        double seconds;
+        std::string file;
+
+        while (in >> seconds && std::getline(in >> std::ws, file)) {
+            auto found = index.find(file);
+            if (found != index.end()) {
+                timings[found->second] = seconds;
+            } else {
+                previous[file] = seconds;
+            }
+        }
+    }
+
+    //units that were not part of this run keep their old timings
+    void saveTimings() {
+        if (TimingsPath.empty()) {
+            return;
+        }
+
+        for (size_t i = 0; i < sources.size(); ++i) {
+            if (timings[i] >= 0) {
+                previous[sources[i]] = timings[i];
+            }
+        }
+
+        std::ofstream out(TimingsPath.c_str());
+        for (const auto& timing : previous) {
+            out << timing.second << "\t" << timing.first << "\n";
+        }
+    }
+
+    const CompilationDatabase& compilations;
+    const std::vector< std::string >& sources;
+
+    std::vector< double > timings;
+    std::vector< unsigned int > attempts;
+    std::map< std::string, double > previous;
+
+    std::vector< Worker > workers;
+    std::deque< uint32_t > queue;
+    std::set< uint32_t > failed;
+
+    int server = -1;
+    pid_t serverPid = -1;
+};
+
+/**
+ * Cheap pass over the include closure of a translation unit using the raw
+ * lexer only, no preprocessing and no Sema. It collects every identifier
+ * that could name a class or namespace, so units that cannot produce a
+ * record matching -M never reach the frontend. Conditional blocks are all
+ * scanned, angled includes are also looked up in the compiler's built-in
+ * search directories, and a unit with an include that is computed or can't
+ * be found is always kept, since it may be generated or reachable only
+ * through flags we don't model.
+ */
+class IncludeScanner {
+public:
+    IncludeScanner(const CompilationDatabase& _compilations) : compilations(_compilations) {
+        for (const std::string& match : IncludeMatches) {
+            //a match can only hit a qualified name if its longest component is part of one name
+            std::string longest;
+            size_t start = 0;
+
+            while (start <= match.size()) {
+                size_t end = match.find("::", start);
+                if (end == std::string::npos) {
+                    end = match.size();
+                }
+                if (end - start > longest.size()) {
+                    longest = match.substr(start, end - start);
+                }
+                start = end + 2;
+            }
+
+            keys.push_back(longest);
+        }
+    }
+
+    bool mayContainMatches(const std::string& source) {
+        std::vector< std::string > quoted, angled, forced;
+        std::string directory;
+
+        std::vector< CompileCommand > commands = compilations.getCompileCommands(source);
+        if (!commands.empty()) {
+            directory = commands[0].Directory;
+            searchPaths(commands[0], quoted, angled, forced);
+
+            const std::vector< std::string >& builtin = builtinSearchPaths(commands[0]);
+            angled.insert(angled.end(), builtin.begin(), builtin.end());
+        }
+
+        std::set< std::string > visited;
+        std::vector< std::string > pending(1, absolute(directory, source));
+
+        //-include files are looked up like quoted includes from the compile directory
+        for (const std::string& name : forced) {
+            std::string resolved = resolve(name, false, directory, quoted, angled);
+            if (resolved.empty()) {
+                return true;
+            }
+            pending.push_back(resolved);
+        }
+
+        while (!pending.empty()) {
+            std::string file = pending.back();
+            pending.pop_back();
+
+            if (!visited.insert(file).second) {
+                continue;
+            }
+
+            const ScanResult* scanned = scan(file);
+            if (!scanned) {
+                continue;
+            }
+            visitedFiles.insert(normalizePath(file));
+
+            if (scanned->matches || scanned->computedInclude) {
+                return true;
+            }
+
+            std::string includer = file.substr(0, file.find_last_of('/'));
+
+            for (const auto& include : scanned->includes) {
+                std::string resolved = resolve(include.first, include.second, includer, quoted, angled);
+                if (resolved.empty()) {
+                    return true;
+                }
+                pending.push_back(resolved);
+            }
+        }
+
+        return false;
+    }
+
+    //every file lexed so far, across all units
+    const std::set< std::string >& scannedFiles() const {
+        return visitedFiles;
+    }
+
+private:
+    struct ScanResult {
+        bool matches = false;
+        //an #include naming a macro, we can't tell what it pulls in
+        bool computedInclude = false;
+        //header name and whether it was spelled with angle brackets
+        std::vector< std::pair< std::string, bool > > includes;
+    };
+
+    static std::string absolute(const std::string& directory, const std::string& path) {
+        if (path.empty() || path[0] == '/' || directory.empty()) {
+            return path;
+        }
+        return directory + "/" + path;
+    }
+
+    static bool readable(const std::string& path) {
+        return access(path.c_str(), R_OK) == 0;
+    }
+
+    static std::string shellQuote(const std::string& arg) {
+        std::string quoted = "'";
+        for (char c : arg) {
+            quoted += c == '\'' ? std::string("'\\''") : std::string(1, c);
+        }
+        return quoted + "'";
+    }
+
+    //the system directories the compiler searches on its own, read from its -v output once per configuration
+    const std::vector< std::string >& builtinSearchPaths(const CompileCommand& command) {
+        static const char* relevant[] = {
+            "-stdlib", "--sysroot", "-isysroot", "-nostdinc", "--gcc-toolchain", "-target", "--target", "-m32", "-m64"
+        };
+
+        const std::vector< std::string >& args = command.CommandLine;
+        if (args.empty()) {
+            static const std::vector< std::string > none;
+            return none;
+        }
+
+        std::string query = "cd " + shellQuote(command.Directory) + " && " + shellQuote(args[0]);
+        for (size_t i = 1; i < args.size(); ++i) {
+            for (const char* flag : relevant) {
+                if (args[i].compare(0, strlen(flag), flag) != 0) {
+                    continue;
+                }
+
+                query += " " + shellQuote(args[i]);
+                //flags taking their value as the next argument
+                if (args[i] == "--sysroot" || args[i] == "-isysroot" || args[i] == "-target" || args[i] == "--gcc-toolchain") {
+                    if (i + 1 < args.size()) {
+                        query += " " + shellQuote(args[++i]);
+                    }
+                }
+                break;
+            }
+        }
+
+        auto known = builtinDirs.find(query);
+        if (known != builtinDirs.end()) {
+            return known->second;
+        }
+
+        std::vector< std::string >& dirs = builtinDirs[query];
+
+        FILE* pipe = popen((query + " -E -x c++ -v - </dev/null 2>&1 >/dev/null").c_str(), "r");
+        if (!pipe) {
+            return dirs;
+        }
+
+        bool inList = false;
+        char line[4096];
+
+        while (fgets(line, sizeof(line), pipe)) {
+            std::string entry(line);
+            entry.erase(entry.find_last_not_of(" \t\r\n") + 1);
+
+            if (entry.find("search starts here:") != std::string::npos) {
+                inList = true;
+            } else if (entry == "End of search list.") {
+                inList = false;
+            } else if (inList) {
+                entry.erase(0, entry.find_first_not_of(" \t"));
+
+                size_t framework = entry.find(" (framework directory)");
+                if (framework != std::string::npos) {
+                    entry.erase(framework);
+                }
+                dirs.push_back(absolute(command.Directory, entry));
+            }
+        }
+
+        pclose(pipe);
+        return dirs;
+    }
+
+    void searchPaths(const CompileCommand& command, std::vector< std::string >& quoted, std::vector< std::string >& angled,
+                     std::vector< std::string >& forced) {
+        const std::vector< std::string >& args = command.CommandLine;
+
+        for (size_t i = 0; i < args.size(); ++i) {
+            if (args[i] == "-include-pch") {
+                ++i;
+                continue;
+            }
+
+            if (args[i].compare(0, 8, "-include") == 0) {
+                std::string name = args[i].size() > 8 ? args[i].substr(8) : (i + 1 < args.size() ? args[++i] : "");
+                if (!name.empty()) {
+                    forced.push_back(name);
+                }
+                continue;
+            }
+
+            static const char* flags[] = { "-iquote", "-I", "-isystem", "-idirafter" };
+
+            for (const char* flag : flags) {
+                size_t len = strlen(flag);
+                if (args[i].compare(0, len, flag) != 0) {
+                    continue;
+                }
+
+                std::string dir = args[i].size() > len ? args[i].substr(len) : (i + 1 < args.size() ? args[++i] : "");
+                dir = absolute(command.Directory, dir);
+
+                if (flag == flags[0]) {
+                    quoted.push_back(dir);
+                } else {
+                    angled.push_back(dir);
+                }
+                break;
+            }
+        }
+    }
+
+    std::string resolve(const std::string& name, bool isAngled, const std::string& includer,
+                        const std::vector< std::string >& quoted, const std::vector< std::string >& angled) {
+        if (!name.empty() && name[0] == '/') {
+            return readable(name) ? name : std::string();
+        }
+
+        if (!isAngled) {
+            std::string candidate = includer + "/" + name;
+            if (readable(candidate)) {
+                return candidate;
+            }
+
+            for (const std::string& dir : quoted) {
+                candidate = dir + "/" + name;
+                if (readable(candidate)) {
+                    return candidate;
+                }
+            }
+        }
+
+        for (const std::string& dir : angled) {
+            std::string candidate = dir + "/" + name;
+            if (readable(candidate)) {
+                return candidate;
+            }
+        }
+
+        return std::string();
+    }
+
+    const ScanResult* scan(const std::string& file) {
+        auto known = byPath.find(file);
+        if (known != byPath.end()) {
+            return known->second;
+        }
+
+        OwningPtr< llvm::MemoryBuffer > buffer;
+        if (llvm::MemoryBuffer::getFile(file, buffer)) {
+            byPath[file] = nullptr;
+            return nullptr;
+        }
+
+        //identical headers living at several paths are only lexed once
+        size_t hash = llvm::hash_value(buffer->getBuffer());
+        auto cached = byHash.find(hash);
+        if (cached != byHash.end()) {
+            return byPath[file] = &cached->second;
+        }
+
+        ScanResult& result = byHash[hash];
+        lex(buffer->getBufferStart(), buffer->getBufferEnd(), result);
+
+        return byPath[file] = &result;
+    }
+
+    void lex(const char* begin, const char* end, ScanResult& result) {
+        LangOptions opts;
+        opts.CPlusPlus = true;
+
+        Lexer lexer(SourceLocation(), opts, begin, begin, end);
+        Token tok;
+
+        //after class/struct/union/namespace every identifier up to the body or base list could be the name
+        bool inRecordHead = false;
+
+        for (;;) {
+            lexer.LexFromRawLexer(tok);
+            if (tok.is(tok::eof)) {
+                break;
+            }
+
+            if (tok.is(tok::hash) && tok.isAtStartOfLine()) {
+                lexer.LexFromRawLexer(tok);
+                if (!tok.is(tok::raw_identifier)) {
+                    continue;
+                }
+
+                StringRef directive(tok.getRawIdentifierData(), tok.getLength());
+                if (directive != "include" && directive != "import" && directive != "include_next") {
+                    continue;
+                }
+
+                lexer.LexFromRawLexer(tok);
+                if (tok.is(tok::string_literal) && tok.getLength() > 2) {
+                    result.includes.push_back(std::make_pair(std::string(tok.getLiteralData() + 1, tok.getLength() - 2), false));
+                } else if (tok.is(tok::less)) {
+                    const char* start = lexer.getBufferLocation();
+                    const char* close = start;
+                    while (close < end && *close != '>' && *close != '\n') {
+                        ++close;
+                    }
+                    if (close < end && *close == '>') {
+                        result.includes.push_back(std::make_pair(std::string(start, close), true));
+                    }
+                } else if (tok.is(tok::raw_identifier)) {
+                    result.computedInclude = true;
+                }
+                continue;
+            }
+
+            if (!tok.is(tok::raw_identifier)) {
+                if (tok.is(tok::l_brace) || tok.is(tok::colon) || tok.is(tok::semi)
+                        || tok.is(tok::greater) || tok.is(tok::comma)) {
+                    inRecordHead = false;
+                }
+                continue;
+            }
+
+            StringRef identifier(tok.getRawIdentifierData(), tok.getLength());
+
+            if (identifier == "class" || identifier == "struct" || identifier == "union" || identifier == "namespace") {
+                inRecordHead = true;
+                continue;
+            }
+
+            if (inRecordHead) {
+                for (const std::string& key : keys) {
+                    if (identifier.find(key) != StringRef::npos) {
+                        result.matches = true;
+                        return;
+                    }
+                }
+            }
+        }
+    }
+
+    const CompilationDatabase& compilations;
+    std::vector< std::string > keys;
+
+    std::unordered_map< std::string, const ScanResult* > byPath;
+    std::unordered_map< size_t, ScanResult > byHash;
+    std::set< std::string > visitedFiles;
+    std::map< std::string, std::vector< std::string > > builtinDirs;
+};
+
+/**
+ * Lua C API backend: writes the binding sources straight from the model,
+ * with no json in between. Every overload set becomes one lua_CFunction
+ * switching on the argument count and trying the candidates in dispatch
+ * order with plain type checks. Objects are userdata holding the class id
+ * and a pointer; the generated cllua_cast walks a static table of
+ * (ancestor id, offset) pairs to adjust the pointer. Virtual bases are left
+ * out of those tables since their offset depends on the dynamic type.
+ */
+class LuaBindingWriter {
+public:
+    LuaBindingWriter(std::ostream& _out, const std::string& _module) : out(_out), module(_module) {
+    }
+
+    void write() {
+        for (ClassDefinition* def : sortedClasses()) {
+            if (bindable(def)) {
+                classes.push_back(def);
+            }
+        }
+
+        writePrologue();
+
+        for (const ClassDefinition* def : classes) {
+            writeClass(*def);
+        }
+
+        writeRegistration();
+    }
+
+private:
+    enum class Kind {
+        unsupported,
+        integer,
+        number,
+        boolean,
+        cstring,
+        string,
+        object
+    };
+
+    //the bindings are a separate unit, they can only use classes a header makes visible to them
+    static bool bindable(const ClassDefinition* def) {
+        return def->processed && !def->isTemplated && def->hasExternalLinkage && def->isAccessible && !def->isInMainFile;
+    }
+
+    static std::string cname(const ClassDefinition& def, const std::string& suffix) {
+        std::ostringstream name;
+        name << "cllua_" << def.classID << "_" << suffix;
+        return name.str();
+    }
+
+    static std::string quoted(const std::string& text) {
+        std::string result = "\"";
+        for (char c : text) {
+            if (c == '"' || c == '\\') {
+                result.push_back('\\');
+            }
+            result.push_back(c);
+        }
+        return result + "\"";
+    }
+
+    static Kind kindOf(const MethodParameter& param, const ClassDefinition*& cls) {
+        cls = nullptr;
+        if (!param.type) {
+            return Kind::unsupported;
+        }
+
+        const std::string& spelling = param.type->spelling;
+
+        auto found = classMapping.find(spelling);
+        if (found != classMapping.end() && bindable(found->second)) {
+            cls = found->second;
+            return Kind::object;
+        }
+
+        Kind kind = Kind::unsupported;
+
+        if (param.isPointer) {
+            //lua strings are interned, the callee must not be able to write into them
+            kind = spelling == "char" && param.isPointeeConst ? Kind::cstring : Kind::unsupported;
+        } else if (isIntegerSpelling(spelling)) {
+            kind = Kind::integer;
+        } else if (isFloatingSpelling(spelling)) {
+            kind = Kind::number;
+        } else if (spelling == "bool") {
+            kind = Kind::boolean;
+        } else if (isStringSpelling(spelling)) {
+            kind = Kind::string;
+        }
+
+        //a temporary can't bind to a mutable reference
+        if (param.isReference && !param.isConst) {
+            return Kind::unsupported;
+        }
+
+        return kind;
+    }
+
+    static bool isVoid(const MethodParameter& param) {
+        return param.type && param.type->spelling == "void" && !param.isPointer && !param.isReference;
+    }
+
+    //fills the check and the converted value for the argument at index, false when we can't bind it
+    static bool argument(const MethodParameter& param, int index, std::string& check, std::string& value) {
+        const ClassDefinition* cls;
+        Kind kind = kindOf(param, cls);
+
+        std::ostringstream c, v;
+
+        switch (kind) {
+        case Kind::integer:
+            c << "cllua_isinteger(L, " << index << ")";
+            v << "static_cast<" << param.type->spelling << ">(lua_tointeger(L, " << index << "))";
+            break;
+        case Kind::number:
+            c << "(lua_type(L, " << index << ") == LUA_TNUMBER)";
+            v << "static_cast<" << param.type->spelling << ">(lua_tonumber(L, " << index << "))";
+            break;
+        case Kind::boolean:
+            c << "lua_isboolean(L, " << index << ")";
+            v << "(lua_toboolean(L, " << index << ") != 0)";
+            break;
+        case Kind::cstring:
+            c << "(lua_type(L, " << index << ") == LUA_TSTRING || lua_isnil(L, " << index << "))";
+            v << "lua_tostring(L, " << index << ")";
+            break;
+        case Kind::string:
+            c << "(lua_type(L, " << index << ") == LUA_TSTRING)";
+            v << "cllua_tostring(L, " << index << ")";
+            break;
+        case Kind::object:
+            if (param.isPointer) {
+                c << "(lua_isnil(L, " << index << ") || cllua_cast(L, " << index << ", " << cls->classID << "))";
+                v << "static_cast< " << cls->qualifiedName << "* >(cllua_cast(L, " << index << ", " << cls->classID << "))";
+            } else {
+                //a by value parameter is a copy the callee destroys
+                if (!param.isReference && !(cls->isCopyConstructible && cls->isDestructible)) {
+                    return false;
+                }
+                c << "cllua_cast(L, " << index << ", " << cls->classID << ")";
+                v << "*static_cast< " << cls->qualifiedName << "* >(cllua_cast(L, " << index << ", " << cls->classID << "))";
+            }
+            break;
+        default:
+            return false;
+        }
+
+        check = c.str();
+        value = v.str();
+        return true;
+    }
+
+    //statement pushing the result of call and returning the number of results, false when we can't
+    static bool result(const MethodParameter& ret, const std::string& call, std::string& statement) {
+        if (isVoid(ret)) {
+            statement = call + "; return 0;";
+            return true;
+        }
+
+        const ClassDefinition* cls;
+        Kind kind = kindOf(ret, cls);
+
+        //returned references never bind temporaries, constness doesn't matter here
+        if (kind == Kind::unsupported && ret.isReference && !ret.isConst) {
+            MethodParameter constRef = ret;
+            constRef.isConst = true;
+            kind = kindOf(constRef, cls);
+        }
+
+        std::ostringstream s;
+
+        switch (kind) {
+        case Kind::integer:
+            s << "lua_pushinteger(L, static_cast<lua_Integer>(" << call << ")); return 1;";
+            break;
+        case Kind::number:
+            s << "lua_pushnumber(L, static_cast<lua_Number>(" << call << ")); return 1;";
+            break;
+        case Kind::boolean:
+            s << "lua_pushboolean(L, (" << call << ") ? 1 : 0); return 1;";
+            break;
+        case Kind::cstring:
+            s << "const char* r = " << call << "; if (r) lua_pushstring(L, r); else lua_pushnil(L); return 1;";
+            break;
+        case Kind::string:
+            s << "const std::string& r = " << call << "; lua_pushlstring(L, r.data(), r.size()); return 1;";
+            break;
+        case Kind::object:
+            if (ret.isPointer) {
+                s << "cllua_push(L, const_cast<void*>(static_cast<const void*>(" << call << ")), " << cls->classID << ", false); return 1;";
+            } else if (ret.isReference) {
+                s << "cllua_push(L, const_cast<void*>(static_cast<const void*>(&(" << call << "))), " << cls->classID << ", false); return 1;";
+            } else if (ownable(*cls) && cls->isMoveConstructible) {
+                s << "cllua_push(L, new " << cls->qualifiedName << "(" << call << "), " << cls->classID << ", true); return 1;";
+            } else {
+                return false;
+            }
+            break;
+        default:
+            return false;
+        }
+
+        statement = s.str();
+        return true;
+    }
+
+    //lua can only own objects it may create and delete
+    static bool ownable(const ClassDefinition& def) {
+        return !def.isAbstract && def.isDestructible;
+    }
+
+    static bool bindableMethod(const MethodDefinition& method) {
+        return !method.isDeleted && method.name.compare(0, 8, "operator") != 0;
+    }
+
+    void writePrologue() {
+        std::set< std::string > headers;
+        for (const ClassDefinition* def : classes) {
+            if (!def->file.empty()) {
+                headers.insert(def->file);
+            }
+        }
+
+        out << "// generated by clang-lua-generator, do not edit\n\n";
+        out << "#include <lua.hpp>\n#include <cmath>\n#include <new>\n#include <string>\n\n";
+        for (const std::string& header : headers) {
+            out << "#include " << quoted(header) << "\n";
+        }
+
+        unsigned int maxId = 0;
+        for (const ClassDefinition* def : classes) {
+            maxId = std::max(maxId, def->classID);
+        }
+
+        out << "\nnamespace {\n\n"
+               "struct cllua_object {\n"
+               "    unsigned int classID;\n"
+               "    void* ptr;\n"
+               "    bool owned;\n"
+               "};\n\n"
+               "struct cllua_upcast {\n"
+               "    unsigned int id;\n"
+               "    long offset;\n"
+               "};\n\n"
+               "struct cllua_class {\n"
+               "    const char* name;\n"
+               "    const cllua_upcast* upcasts;\n"
+               "    unsigned int count;\n"
+               "};\n\n";
+
+        for (const ClassDefinition* def : classes) {
+            out << "const cllua_upcast " << cname(*def, "upcasts") << "[] = {\n";
+            out << "    { " << def->classID << ", 0 },\n";
+
+            for (const auto& upcast : def->upcasts) {
+                auto base = classMapping.find(upcast.qualifiedName);
+                if (!upcast.isVirtual && base != classMapping.end() && base->second->classID) {
+                    out << "    { " << base->second->classID << ", " << upcast.offset << " },\n";
+                }
+            }
+            out << "};\n\n";
+        }
+
+        out << "const cllua_class cllua_classes[" << (maxId + 1) << "] = {\n";
+        std::vector< const ClassDefinition* > byId(maxId + 1, nullptr);
+        for (const ClassDefinition* def : classes) {
+            byId[def->classID] = def;
+        }
+        for (const ClassDefinition* def : byId) {
+            if (def) {
+                out << "    { " << quoted(def->qualifiedName) << ", " << cname(*def, "upcasts")
+                    << ", sizeof(" << cname(*def, "upcasts") << ") / sizeof(cllua_upcast) },\n";
+            } else {
+                out << "    { 0, 0, 0 },\n";
+            }
+        }
+        out << "};\n\n";
+
+        out << "const unsigned int cllua_class_count = " << (maxId + 1) << ";\n\n"
+               "//pointer to the target class inside the userdata at idx, null when it isn't one\n"
+               "void* cllua_cast(lua_State* L, int idx, unsigned int target) {\n"
+               "    if (lua_type(L, idx) != LUA_TUSERDATA || !lua_getmetatable(L, idx)) {\n"
+               "        return 0;\n"
+               "    }\n"
+               "    lua_getfield(L, -1, \"__cllua\");\n"
+               "    bool ours = lua_toboolean(L, -1) != 0;\n"
+               "    lua_pop(L, 2);\n"
+               "    if (!ours) {\n"
+               "        return 0;\n"
+               "    }\n\n"
+               "    cllua_object* obj = static_cast<cllua_object*>(lua_touserdata(L, idx));\n"
+               "    if (!obj->ptr || obj->classID >= cllua_class_count) {\n"
+               "        return 0;\n"
+               "    }\n\n"
+               "    const cllua_class& cls = cllua_classes[obj->classID];\n"
+               "    for (unsigned int i = 0; i < cls.count; ++i) {\n"
+               "        if (cls.upcasts[i].id == target) {\n"
+               "            return static_cast<char*>(obj->ptr) + cls.upcasts[i].offset;\n"
+               "        }\n"
+               "    }\n"
+               "    return 0;\n"
+               "}\n\n"
+               "//numbers with a fractional part must not pick an integer overload\n"
+               "bool cllua_isinteger(lua_State* L, int idx) {\n"
+               "    if (lua_type(L, idx) != LUA_TNUMBER) {\n"
+               "        return false;\n"
+               "    }\n"
+               "    lua_Number n = lua_tonumber(L, idx);\n"
+               "    return std::floor(n) == n;\n"
+               "}\n\n"
+               "std::string cllua_tostring(lua_State* L, int idx) {\n"
+               "    size_t length = 0;\n"
+               "    const char* data = lua_tolstring(L, idx, &length);\n"
+               "    return std::string(data, length);\n"
+               "}\n\n"
+               "void* cllua_self(lua_State* L, unsigned int target) {\n"
+               "    void* self = cllua_cast(L, 1, target);\n"
+               "    if (!self) {\n"
+               "        luaL_error(L, \"expected a %s as self\", cllua_classes[target].name);\n"
+               "    }\n"
+               "    return self;\n"
+               "}\n\n"
+               "void cllua_push(lua_State* L, void* ptr, unsigned int id, bool owned) {\n"
+               "    if (!ptr) {\n"
+               "        lua_pushnil(L);\n"
+               "        return;\n"
+               "    }\n"
+               "    cllua_object* obj = static_cast<cllua_object*>(lua_newuserdata(L, sizeof(cllua_object)));\n"
+               "    obj->classID = id;\n"
+               "    obj->ptr = ptr;\n"
+               "    obj->owned = owned;\n"
+               "    luaL_getmetatable(L, cllua_classes[id].name);\n"
+               "    lua_setmetatable(L, -2);\n"
+               "}\n\n";
+    }
+
+    //one switch over the argument count, first is the stack index of the first argument
+    void writeDispatch(const ClassDefinition& def, const std::map< size_t, std::vector< size_t > >& arities,
+                       int first, const std::string& callee, bool constructor) {
+        out << "    switch (lua_gettop(L) - " << (first - 1) << ") {\n";
+
+        for (const auto& arity : arities) {
+            out << "    case " << arity.first << ":\n";
+
+            for (size_t index : arity.second) {
+                const MethodDefinition& method = def.methods[index];
+                if (!bindableMethod(method)) {
+                    continue;
+                }
+
+                std::vector< std::string > checks, values;
+                bool supported = true;
+
+                //parameters past the arity take their default arguments
+                for (size_t i = 0; i < arity.first && supported; ++i) {
+                    std::string check, value;
+                    supported = argument(method.parameters[i], first + i, check, value);
+                    checks.push_back(check);
+                    values.push_back(value);
+                }
+
+                std::string call = callee + "(";
+                for (size_t i = 0; i < values.size(); ++i) {
+                    call += (i ? ", " : "") + values[i];
+                }
+                call += ")";
+
+                std::string statement;
+                if (constructor) {
+                    std::ostringstream s;
+                    s << "cllua_push(L, " << call << ", " << def.classID << ", true); return 1;";
+                    statement = s.str();
+                } else {
+                    supported = supported && result(method.retType, call, statement);
+                }
+
+                if (!supported) {
+                    out << "        // " << method.name << " " << method.key << ": unsupported signature\n";
+                    continue;
+                }
+
+                out << "        if (true";
+                for (const std::string& check : checks) {
+                    out << "\n            && " << check;
+                }
+                out << ") {\n            " << statement << "\n        }\n";
+            }
+
+            out << "        break;\n";
+        }
+
+        out << "    }\n";
+    }
+
+    void writeClass(const ClassDefinition& def) {
+        const std::string& type = def.qualifiedName;
+
+        out << "// " << type << "\n\n";
+
+        for (const auto& set : overloadSets(def, false)) {
+            if (set.first.compare(0, 8, "operator") == 0) {
+                continue;
+            }
+
+            out << "int " << cname(def, "m_" + set.first) << "(lua_State* L) {\n";
+            out << "    " << type << "* self = static_cast< " << type << "* >(cllua_self(L, " << def.classID << "));\n";
+            writeDispatch(def, set.second, 2, "self->" + set.first, false);
+            out << "    return luaL_error(L, \"no overload of %s matches the arguments\", " << quoted(type + "::" + set.first) << ");\n";
+            out << "}\n\n";
+        }
+
+        if (!ownable(def)) {
+            return;
+        }
+
+        out << "int " << cname(def, "new") << "(lua_State* L) {\n";
+        for (const auto& set : overloadSets(def, true)) {
+            writeDispatch(def, set.second, 1, "new " + type, true);
+        }
+        out << "    return luaL_error(L, \"no constructor of %s matches the arguments\", " << quoted(type) << ");\n";
+        out << "}\n\n";
+
+        out << "int " << cname(def, "gc") << "(lua_State* L) {\n"
+            << "    cllua_object* obj = static_cast<cllua_object*>(lua_touserdata(L, 1));\n"
+            << "    if (obj->owned) {\n"
+            << "        delete static_cast< " << type << "* >(obj->ptr);\n"
+            << "        obj->ptr = 0;\n"
+            << "    }\n"
+            << "    return 0;\n"
+            << "}\n\n";
+    }
+
+    void writeRegistration() {
+        out << "}\n\n"
+            << "extern \"C\" int luaopen_" << module << "(lua_State* L) {\n"
+            << "    lua_newtable(L);\n\n";
+
+        for (const ClassDefinition* def : classes) {
+            out << "    luaL_newmetatable(L, " << quoted(def->qualifiedName) << ");\n"
+                << "    lua_pushboolean(L, 1);\n"
+                << "    lua_setfield(L, -2, \"__cllua\");\n";
+            if (ownable(*def)) {
+                out << "    lua_pushcfunction(L, " << cname(*def, "gc") << ");\n"
+                    << "    lua_setfield(L, -2, \"__gc\");\n";
+            }
+            out << "    lua_newtable(L);\n";
+
+            //inherited functions are registered directly, their self check accepts derived objects
+            std::vector< FlatMember > members;
+            flattenMembers(*def, members);
+
+            for (const FlatMember& member : members) {
+                if (std::string(member.kind) != "function" || !bindable(member.owner)
+                        || member.name.compare(0, 8, "operator") == 0) {
+                    continue;
+                }
+                out << "    lua_pushcfunction(L, " << cname(*member.owner, "m_" + member.name) << ");\n"
+                    << "    lua_setfield(L, -2, " << quoted(member.name) << ");\n";
+            }
+
+            out << "    lua_setfield(L, -2, \"__index\");\n"
+                << "    lua_pop(L, 1);\n";
+
+            out << "    lua_newtable(L);\n";
+            if (ownable(*def)) {
+                out << "    lua_pushcfunction(L, " << cname(*def, "new") << ");\n"
+                    << "    lua_setfield(L, -2, \"new\");\n";
+            }
+            out << "    lua_setfield(L, -2, " << quoted(def->qualifiedName) << ");\n\n";
+        }
+
+        out << "    return 1;\n"
+            << "}\n";
+    }
+
+    std::ostream& out;
+    std::string module;
+    std::vector< const ClassDefinition* > classes;
+};
+
+std::string escapeDependency(const std::string& path) {
+    std::string escaped;
+    for (char c : path) {
+        if (c == ' ' || c == '#') {
+            escaped.push_back('\\');
+        } else if (c == '$') {
+            escaped.push_back('$');
+        }
+        escaped.push_back(c);
+    }
+    return escaped;
+}
+
+/**
+ * Make style depfile listing the selected sources, the headers the prefilter
+ * looked at and every file the parsed units read, so the build can skip us
+ * when none of them changed.
+ */
+void writeDepfile(const std::string& path, const std::string& target, const std::vector< std::string >& sources,
+                  const std::set< std::string >& headers) {
+    std::set< std::string > files(sources.begin(), sources.end());
+    files.insert(headers.begin(), headers.end());
+    files.insert(inputFiles.begin(), inputFiles.end());
+
+    for (const auto& cls : classMapping) {
+        if (cls.second->processed && !cls.second->file.empty()) {
+            files.insert(cls.second->file);
+        }
+    }
+
+    std::ofstream out(path.c_str());
+    out << escapeDependency(target) << ":";
+
+    for (const std::string& file : files) {
+        out << " \\\n  " << escapeDependency(file);
+    }
+
+    out << "\n";
+}
+
+/**
+ * compile_commands.json reader for very large databases. The file is mapped
+ * and scanned once to find the object boundaries and the file of each entry,
+ * command lines are only decoded for the units that actually get run.
+ * Entries repeating a file collapse into the first one.
+ */
+class LazyCompilationDatabase : public CompilationDatabase {
+public:
+    static LazyCompilationDatabase* load(const std::string& path, std::string& error) {
+        OwningPtr< llvm::MemoryBuffer > buffer;
+        if (llvm::MemoryBuffer::getFile(path, buffer)) {
+            error = "cannot read " + path;
+            return nullptr;
+        }
+
+        LazyCompilationDatabase* database = new LazyCompilationDatabase(buffer.take());
+        if (!database->index(error)) {
+            delete database;
+            return nullptr;
+        }
+
+        return database;
+    }
+
+    virtual std::vector< CompileCommand > getCompileCommands(StringRef FilePath) const {
+        std::vector< CompileCommand > commands;
+
+        auto found = byFile.find(normalizePath(FilePath.str()));
+        if (found != byFile.end()) {
+            commands.push_back(decode(entries[found->second]));
+        }
+
+        return commands;
+    }
+
+    virtual std::vector< std::string > getAllFiles() const {
+        std::vector< std::string > files;
+        for (const Entry& entry : entries) {
+            files.push_back(entry.file);
+        }
+        return files;
+    }
+
+    virtual std::vector< CompileCommand > getAllCompileCommands() const {
+        std::vector< CompileCommand > commands;
+        for (const Entry& entry : entries) {
+            commands.push_back(decode(entry));
+        }
+        return commands;
+    }
+
+private:
+    struct Entry {
+        std::string file;
+        std::string directory;
+        const char* begin;
+        const char* end;
+    };
+
+    LazyCompilationDatabase(llvm::MemoryBuffer* _buffer) : buffer(_buffer) {
+    }
+
+    static const char* skipSpace(const char* p, const char* end) {
+        while (p < end && (*p == ' ' || *p == '\t' || *p == '\n' || *p == '\r')) {
+            ++p;
+        }
+        return p;
+    }
+
+    //p points at the opening quote, returns the position after the closing one
+    static const char* skipString(const char* p, const char* end) {
+        for (++p; p < end; ++p) {
+            if (*p == '\\') {
+                ++p;
+            } else if (*p == '"') {
+                return p + 1;
+            }
+        }
+        return nullptr;
+    }
+
+    static const char* skipValue(const char* p, const char* end) {
+        int depth = 0;
+
+        while (p && p < end) {
+            char c = *p;
+            if (c == '"') {
+                p = skipString(p, end);
+                if (depth == 0) {
+                    return p;
+                }
+                continue;
+            }
+
+            if (c == '{' || c == '[') {
+                ++depth;
+            } else if (c == '}' || c == ']') {
+                //at depth 0 this closes the enclosing container and ends a scalar
+                if (depth == 0) {
+                    return p;
+                }
+                if (--depth == 0) {
+                    return p + 1;
+                }
+            } else if (depth == 0 && (c == ',' || c == ' ' || c == '\n' || c == '\r' || c == '\t')) {
+                return p;
+            }
+            ++p;
+        }
+
+        return depth == 0 ? p : nullptr;
+    }
+
+    static std::string unescape(const char* begin, const char* end) {
+        std::string out;
+
+        for (const char* p = begin + 1; p < end - 1; ++p) {
+            if (*p != '\\' || p + 1 >= end - 1) {
+                out.push_back(*p);
+                continue;
+            }
+
+            switch (*++p) {
+            case 'b': out.push_back('\b'); break;
+            case 'f': out.push_back('\f'); break;
+            case 'n': out.push_back('\n'); break;
+            case 'r': out.push_back('\r'); break;
+            case 't': out.push_back('\t'); break;
+            case 'u': {
+                if (end - 1 - p < 5) {
+                    break;
+                }
+                unsigned int code = strtoul(std::string(p + 1, p + 5).c_str(), nullptr, 16);
+                p += 4;
+
+                if (code < 0x80) {
+                    out.push_back(static_cast<char>(code));
+                } else if (code < 0x800) {
+                    out.push_back(static_cast<char>(0xc0 | (code >> 6)));
+                    out.push_back(static_cast<char>(0x80 | (code & 0x3f)));
+                } else {
+                    out.push_back(static_cast<char>(0xe0 | (code >> 12)));
+                    out.push_back(static_cast<char>(0x80 | ((code >> 6) & 0x3f)));
+                    out.push_back(static_cast<char>(0x80 | (code & 0x3f)));
+                }
+            }
+            break;
+            default: out.push_back(*p); break;
+            }
+        }
+
+        return out;
+    }
+
+    /**
+     * Walks the members of the object starting at p, calling visit with the
+     * key and the raw value bounds. Returns the position after the object.
+     */
+    template <typename Visitor>
+    static const char* members(const char* p, const char* end, Visitor visit) {
+        p = skipSpace(p + 1, end);
+
+        while (p && p < end && *p != '}') {
+            if (*p != '"') {
+                return nullptr;
+            }
+
+            const char* keyEnd = skipString(p, end);
+            if (!keyEnd) {
+                return nullptr;
+            }
+            StringRef key(p + 1, keyEnd - p - 2);
+
+            p = skipSpace(keyEnd, end);
+            if (p >= end || *p != ':') {
+                return nullptr;
+            }
+
+            const char* value = skipSpace(p + 1, end);
+            p = skipValue(value, end);
+            if (!p) {
+                return nullptr;
+            }
+
+            visit(key, value, p);
+
+            p = skipSpace(p, end);
+            if (p < end && *p == ',') {
+                p = skipSpace(p + 1, end);
+            }
+        }
+
+        return p && p < end ? p + 1 : nullptr;
+    }
+
+    bool index(std::string& error) {
+        const char* p = buffer->getBufferStart();
+        const char* end = buffer->getBufferEnd();
+
+        p = skipSpace(p, end);
+        if (p >= end || *p != '[') {
+            error = "compilation database is not a json array";
+            return false;
+        }
+
+        p = skipSpace(p + 1, end);
+
+        while (p < end && *p != ']') {
+            if (*p != '{') {
+                error = "compilation database entries must be objects";
+                return false;
+            }
+
+            Entry entry;
+            entry.begin = p;
+
+            const char* file = nullptr;
+            const char* fileEnd = nullptr;
+
+            p = members(p, end, [&](StringRef key, const char* value, const char* valueEnd) {
+                if (key == "file" && *value == '"') {
+                    file = value;
+                    fileEnd = valueEnd;
+                } else if (key == "directory" && *value == '"') {
+                    entry.directory = unescape(value, valueEnd);
+                }
+            });
+
+            if (!p) {
+                error = "malformed compilation database entry";
+                return false;
+            }
+
+            entry.end = p;
+
+            if (file) {
+                std::string name = unescape(file, fileEnd);
+                entry.file = normalizePath(name.empty() || name[0] == '/' || entry.directory.empty() ? name : entry.directory + "/" + name);
+
+                if (byFile.insert(std::make_pair(entry.file, entries.size())).second) {
+                    entries.push_back(entry);
+                }
+            }
+
+            p = skipSpace(p, end);
+            if (p < end && *p == ',') {
+                p = skipSpace(p + 1, end);
+            }
+        }
+
+        return true;
+    }
+
+    //splits a shell command the way the build wrote it, honouring quotes and backslashes
+    static std::vector< std::string > splitCommand(const std::string& command) {
+        std::vector< std::string > args;
+        std::string current;
+        bool inArg = false;
+        char quote = 0;
+
+        for (size_t i = 0; i < command.size(); ++i) {
+            char c = command[i];
+
+            if (quote) {
+                if (c == quote) {
+                    quote = 0;
+                } else if (c == '\\' && quote == '"' && i + 1 < command.size()) {
+                    current.push_back(command[++i]);
+                } else {
+                    current.push_back(c);
+                }
+            } else if (c == '"' || c == '\'') {
+                quote = c;
+                inArg = true;
+            } else if (c == '\\' && i + 1 < command.size()) {
+                current.push_back(command[++i]);
+                inArg = true;
+            } else if (c == ' ' || c == '\t' || c == '\n') {
+                if (inArg) {
+                    args.push_back(current);
+                    current.clear();
+                    inArg = false;
+                }
+            } else {
+                current.push_back(c);
+                inArg = true;
+            }
+        }
+
+        if (inArg) {
+            args.push_back(current);
+        }
+
+        return args;
+    }
+
+    CompileCommand decode(const Entry& entry) const {
+        std::vector< std::string > commandLine;
+
+        members(entry.begin, entry.end, [&](StringRef key, const char* value, const char* valueEnd) {
+            if (key == "command" && *value == '"') {
+                commandLine = splitCommand(unescape(value, valueEnd));
+            } else if (key == "arguments" && *value == '[') {
+                const char* p = skipSpace(value + 1, valueEnd);
+                while (p && p < valueEnd && *p == '"') {
+                    const char* argEnd = skipString(p, valueEnd);
+                    if (!argEnd) {
+                        break;
+                    }
+                    commandLine.push_back(unescape(p, argEnd));
+                    p = skipSpace(argEnd, valueEnd);
+                    if (p < valueEnd && *p == ',') {
+                        p = skipSpace(p + 1, valueEnd);
+                    }
+                }
+            }
+        });
+
+        return CompileCommand(entry.directory, commandLine);
+    }
+
+    OwningPtr< llvm::MemoryBuffer > buffer;
+    std::vector< Entry > entries;
+    std::unordered_map< std::string, size_t > byFile;
+};
+
+/**
+ * Turns a -include-tu/-exclude-tu pattern into a regex. Patterns are globs
+ * matched against the whole absolute path, where * stays inside one
+ * directory and ** crosses them; a re: prefix takes the rest as a regex.
+ */
+std::string sourcePatternToRegex(const std::string& pattern) {
+    if (pattern.compare(0, 3, "re:") == 0) {
+        return pattern.substr(3);
+    }
+
+    std::string regex = "^";
+    for (size_t i = 0; i < pattern.size(); ++i) {
+        char c = pattern[i];
+
+        if (c == '*') {
+            if (i + 1 < pattern.size() && pattern[i + 1] == '*') {
+                regex += ".*";
+                ++i;
+            } else {
+                regex += "[^/]*";
+            }
+        } else if (c == '?') {
+            regex += "[^/]";
+        } else {
+            if (strchr(".^$|()[]{}+\\", c)) {
+                regex.push_back('\\');
+            }
+            regex.push_back(c);
+        }
+    }
+
+    return regex + "$";
+}
+
+bool compileSourcePatterns(const llvm::cl::list< std::string >& patterns, std::vector< std::unique_ptr< llvm::Regex > >& regexes) {
+    for (const std::string& pattern : patterns) {
+        regexes.push_back(std::unique_ptr< llvm::Regex >(new llvm::Regex(sourcePatternToRegex(pattern))));
+
+        std::string error;
+        if (!regexes.back()->isValid(error)) {
+            std::cerr << "clang-lua-generator: bad pattern " << pattern << ": " << error << std::endl;
+            return false;
+        }
+    }
+    return true;
+}
+
+/**
+ * The sources to run: the positional arguments, or every file in the
+ * database with -all, narrowed by -include-tu and -exclude-tu.
+ */
+bool selectSources(const CompilationDatabase& compilations, std::vector< std::string >& sources) {
+    std::vector< std::unique_ptr< llvm::Regex > > includes, excludes;
+    if (!compileSourcePatterns(IncludeSources, includes) || !compileSourcePatterns(ExcludeSources, excludes)) {
+        return false;
+    }
+
+    std::vector< std::string > candidates;
+    if (AllSources) {
+        candidates = compilations.getAllFiles();
+    } else {
+        candidates.assign(SourcePaths.begin(), SourcePaths.end());
+    }
+
+    std::set< std::string > seen;
+
+    for (const std::string& candidate : candidates) {
+        std::string path = normalizePath(candidate);
+
+        if (!seen.insert(path).second) {
+            continue;
+        }
+
+        bool selected = includes.empty();
+        for (const auto& regex : includes) {
+            selected = selected || regex->match(path);
+        }
+        for (const auto& regex : excludes) {
+            selected = selected && !regex->match(path);
+        }
+
+        if (selected) {
+            sources.push_back(path);
+        }
+    }
+
+    return true;
+}
+
+//like clang's own tools, look for compile_commands.json in -p or above the first source
+CompilationDatabase* loadCompilations(std::string& error) {
+    std::string dir = BuildPath;
+
+    if (dir.empty()) {
+        dir = SourcePaths.empty() ? normalizePath(".") : normalizePath(SourcePaths[0]);
+
+        while (!dir.empty()) {
+            if (access((dir + "/compile_commands.json").c_str(), R_OK) == 0) {
+                break;
+            }
+            size_t slash = dir.find_last_of('/');
+            dir = slash == std::string::npos ? std::string() : dir.substr(0, slash);
+        }
+
+        if (dir.empty()) {
+            error = "could not find compile_commands.json, pass its directory with -p";
+            return nullptr;
+        }
+    }
+
+    std::string path = dir;
+    if (path.size() < 5 || path.compare(path.size() - 5, 5, ".json") != 0) {
+        path += "/compile_commands.json";
+    }
+
+    return LazyCompilationDatabase::load(path, error);
+}
+
+int main ( int argc, const char** argv ) {
+    OwningPtr< CompilationDatabase > compilations(FixedCompilationDatabase::loadFromCommandLine(argc, argv));
+    llvm::cl::ParseCommandLineOptions(argc, argv);
+
+    //ClangTool changes into the directory of each compile command, resolve our own files up front
+    std::string outputTarget = OutputPath;
+    for (llvm::cl::opt<std::string>* path : { &OutputPath, &DepfilePath, &LuaOutputPath, &ClassIdsPath, &TimingsPath }) {
+        if (!path->empty()) {
+            *path = normalizePath(*path);
+        }
+    }
+
+    //streamed ids are handed out as units finish, which varies between runs, only a map keeps them stable
+    if (StreamOutput && ClassIdsPath.empty()) {
+        ClassIdsPath = OutputPath + ".ids";
+    }
+
+    if (!compilations) {
+        std::string error;
+        compilations.reset(loadCompilations(error));
+
+        if (!compilations) {
+            std::cerr << "clang-lua-generator: " << error << std::endl;
+            return 1;
+        }
+    }
+
+    std::vector< std::string > sources;
+    if (!selectSources(*compilations, sources)) {
+        return 1;
+    }
+
+    //units dropped by the prefilter still belong in the depfile, editing them may bring them back
+    std::vector< std::string > selected = sources;
+    std::set< std::string > scannedHeaders;
+
+    if (Prefilter && !IncludeMatches.empty()) {
+        IncludeScanner scanner(*compilations);
+        size_t total = sources.size();
+
+        sources.erase(std::remove_if(sources.begin(), sources.end(), [&scanner](const std::string& source) {
+            return !scanner.mayContainMatches(source);
+        }), sources.end());
+
+        scannedHeaders = scanner.scannedFiles();
+
+        std::cerr << "clang-lua-generator: prefilter kept " << sources.size() << " of " << total << " translation units" << std::endl;
+    }
+
+    if (!ClassIdsPath.empty()) {
+        loadClassIds();
+    }
+
+    //workers are forked from a server that has to exist before the writer thread does
+    std::unique_ptr< WorkerPool > pool;
+    if (Jobs > 0) {
+        pool.reset(new WorkerPool(*compilations, sources));
+        pool->start();
+    }
+
+    std::unique_ptr< NdjsonWriter > writer;
+    if (StreamOutput) {
+        writer.reset(new NdjsonWriter(OutputPath));
+        streamWriter = writer.get();
+    }
+
+    int result;
+
+    if (pool) {
+        result = pool->run(Jobs);
+    } else {
+        ClangTool tool(*compilations, sources);
+        result = tool.run ( newFrontendActionFactory<BuildLuaBindingsAction>() );
+
+        if (UseFileCache) {
+            fileCache.report(std::cerr);
+        }
+    }
+
+    if (!DepfilePath.empty()) {
+        writeDepfile(DepfilePath, outputTarget, selected, scannedHeaders);
+    }
+
+    if (!LuaOutputPath.empty()) {
+        assignClassIds();
+
+        std::ofstream lua(LuaOutputPath.c_str());
+        LuaBindingWriter(lua, LuaModule).write();
+    }
+
+    if (writer) {
+        streamWriter = nullptr;
+        writer->finish();
+
+        if (!ClassIdsPath.empty()) {
+            saveClassIds();
+        }
+        return result;
+    }
+
+    assignClassIds();
+    computeTypeRanges();
+    markOverriddenMethods();
+
+    if (!ClassIdsPath.empty()) {
+        saveClassIds();
+    }
+
+    std::ofstream of;
+    of.open(OutputPath, std::ofstream::out);
+       
+    gdx::JsonValue json;
+
+    if (TypeTable) {
+        indexTypes(json["types"]);
+    }
+
+    if (!classMapping.empty()) {
+        serializeClasses(json["classes"], !CompactOutput, SerializeThreads);
     }
 
-    std::string jsonstr = json.toString();
+    std::string buffer;
+    buffer.reserve(1 << 22);
+    json.toString(buffer, !CompactOutput);
     
-    of << jsonstr;
+    of.write(buffer.data(), buffer.size());
     of.close();
     
     return result;